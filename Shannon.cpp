@@ -1,5 +1,8 @@
+#include "Shannon.h"
+
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <map>
 #include <cmath>
@@ -7,226 +10,3513 @@
 #include <string>
 #include <limits>
 #include <cctype>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <span>
+#include <cstring>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SHANNON_X86 1
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang compile single functions for a newer instruction set, so
+// the bit I/O kernels get a BMI2 build (shlx/shrx for their variable
+// shifts) next to the baseline one and the CPU picks at run time.
+// SHANNON_NO_BMI2 leaves only the baseline, to benchmark one against the other.
+#if defined(SHANNON_X86) && defined(__GNUC__) && !defined(SHANNON_NO_BMI2)
+#define SHANNON_BMI2 1
+#endif
+#ifdef __GNUC__
+#define SHANNON_FLATTEN __attribute__((flatten))
+#else
+#define SHANNON_FLATTEN
+#endif
 
 using namespace std;
 
+namespace shannon {
+
+// Everything but the interface in Shannon.h. The benchmark and the fuzz
+// target compile this file in and reach these through shannon::detail.
+namespace detail {
+
+// Codes are stored packed: the low `length` bits of `code`, most significant
+// bit first on the wire.
 struct SymbolInfo {
     unsigned char symbol;
     double probability;
+    uint64_t code;
+    uint8_t length;
+};
+
+constexpr int MAX_CODE_LENGTH = 64;
+
+// Debug view of a packed code as a string of '0'/'1'
+string codeString(const SymbolInfo& info) {
     string code;
+    for (int i = info.length - 1; i >= 0; --i) {
+        code += ((info.code >> i) & 1) ? '1' : '0';
+    }
+    return code;
+}
+
+// Read-only view of a whole input file. The file is memory-mapped so the
+// coders work on the page cache directly; inputs that cannot be mapped
+// (pipes, some special files) are read into memory instead.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const string& path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER file_size;
+        if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping) {
+                void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                if (view) {
+                    mapped = static_cast<const unsigned char*>(view);
+                    length = static_cast<size_t>(file_size.QuadPart);
+                    return true;
+                }
+            }
+        }
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED) {
+                madvise(view, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+                mapped = static_cast<const unsigned char*>(view);
+                length = static_cast<size_t>(st.st_size);
+                return true;
+            }
+        }
+#endif
+        return readAll();
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (mapped) UnmapViewOfFile(mapped);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (mapped) munmap(const_cast<unsigned char*>(mapped), length);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        mapped = nullptr;
+        length = 0;
+        fallback.clear();
+    }
+
+    span<const unsigned char> bytes() const {
+        return mapped ? span<const unsigned char>(mapped, length) : span<const unsigned char>(fallback);
+    }
+
+    // Starts reading a range the coder will need soon without waiting for
+    // it, so the device works while earlier blocks are coded. Windows reads
+    // ahead of a sequential-scan mapping on its own.
+    void prefetch(size_t offset, size_t size) const {
+#ifndef _WIN32
+        if (!mapped || offset >= length) return;
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t start = offset / page * page;
+        size_t end = min(length, offset + size);
+        madvise(const_cast<unsigned char*>(mapped) + start, end - start, MADV_WILLNEED);
+#else
+        (void)offset;
+        (void)size;
+#endif
+    }
+
+private:
+    const unsigned char* mapped = nullptr;
+    size_t length = 0;
+    vector<unsigned char> fallback;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+
+    bool readAll() {
+        unsigned char chunk[1 << 16];
+        DWORD got = 0;
+        while (ReadFile(file, chunk, sizeof(chunk), &got, nullptr) && got > 0) {
+            fallback.insert(fallback.end(), chunk, chunk + got);
+        }
+        return true;
+    }
+#else
+    int fd = -1;
+
+    bool readAll() {
+        unsigned char chunk[1 << 16];
+        ssize_t got;
+        while ((got = ::read(fd, chunk, sizeof(chunk))) > 0) {
+            fallback.insert(fallback.end(), chunk, chunk + got);
+        }
+        return got == 0;
+    }
+#endif
 };
 
-map<unsigned char, double> calculateProbabilities(const string& data) {
-    map<unsigned char, int> freq;
-    for (unsigned char c : data) freq[c]++;
+// Output file of a size known up front, mapped writable so several threads
+// can fill disjoint ranges in place. Falls back to an in-memory buffer that
+// is written out on close when the file cannot be mapped.
+class MappedOutput {
+public:
+    MappedOutput() = default;
+    MappedOutput(const MappedOutput&) = delete;
+    MappedOutput& operator=(const MappedOutput&) = delete;
+    ~MappedOutput() { close(); }
 
-    map<unsigned char, double> prob;
-    int total = data.size();
-    for (const auto& pair : freq) {
-        prob[pair.first] = static_cast<double>(pair.second) / total;
+    bool create(const string& path, size_t size) {
+        length = size;
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        if (size == 0) return true;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(uint64_t(size) >> 32),
+            static_cast<DWORD>(size), nullptr);
+        if (mapping) {
+            mapped = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size));
+        }
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        if (size == 0) return true;
+        if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+            void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (view != MAP_FAILED) mapped = static_cast<unsigned char*>(view);
+        }
+#endif
+        if (!mapped) fallback.resize(size);
+        return true;
+    }
+
+    unsigned char* data() { return mapped ? mapped : fallback.data(); }
+
+    // Starts writeback of a finished range without waiting for it, so the
+    // device is busy while later blocks are decoded instead of all at close
+    void flush(size_t offset, size_t size) {
+        if (!mapped || offset >= length) return;
+        size = min(size, length - offset);
+#ifdef _WIN32
+        FlushViewOfFile(mapped + offset, size);
+#elif defined(__linux__)
+        sync_file_range(fd, static_cast<off_t>(offset), static_cast<off_t>(size), SYNC_FILE_RANGE_WRITE);
+#else
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t start = offset / page * page;
+        msync(mapped + start, offset + size - start, MS_ASYNC);
+#endif
+    }
+
+    bool close() {
+        bool ok = true;
+#ifdef _WIN32
+        if (mapped) ok = UnmapViewOfFile(mapped) != 0;
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) {
+            DWORD written = 0;
+            if (!mapped && !fallback.empty()) {
+                ok = WriteFile(file, fallback.data(), static_cast<DWORD>(fallback.size()), &written, nullptr) != 0
+                    && written == fallback.size();
+            }
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (mapped) ok = munmap(mapped, length) == 0;
+        if (fd >= 0) {
+            size_t done = 0;
+            while (!mapped && done < fallback.size()) {
+                ssize_t n = ::write(fd, fallback.data() + done, fallback.size() - done);
+                if (n <= 0) {
+                    ok = false;
+                    break;
+                }
+                done += static_cast<size_t>(n);
+            }
+            ok = (::close(fd) == 0) && ok;
+        }
+        fd = -1;
+#endif
+        mapped = nullptr;
+        length = 0;
+        fallback.clear();
+        return ok;
+    }
+
+private:
+    unsigned char* mapped = nullptr;
+    size_t length = 0;
+    vector<unsigned char> fallback;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+// Byte counts indexed by symbol
+using Histogram = array<uint64_t, 256>;
+using Probabilities = array<double, 256>;
+
+// Adds the byte counts of `data` to `hist`, so large inputs can be counted
+// chunk by chunk. Counting goes through four interleaved tables: runs of one
+// byte would otherwise serialize on a single counter through store-to-load
+// forwarding.
+void accumulateHistogram(span<const unsigned char> data, Histogram& hist) {
+    // 32-bit lanes are flushed before any of them could overflow
+    constexpr size_t FLUSH_INTERVAL = size_t(1) << 30;
+    uint32_t lanes[4][256];
+
+    const unsigned char* p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        memset(lanes, 0, sizeof(lanes));
+        size_t n = min(left, FLUSH_INTERVAL);
+        const unsigned char* end = p + n;
+        while (end - p >= 8) {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            lanes[0][word & 0xFF]++;
+            lanes[1][(word >> 8) & 0xFF]++;
+            lanes[2][(word >> 16) & 0xFF]++;
+            lanes[3][(word >> 24) & 0xFF]++;
+            lanes[0][(word >> 32) & 0xFF]++;
+            lanes[1][(word >> 40) & 0xFF]++;
+            lanes[2][(word >> 48) & 0xFF]++;
+            lanes[3][word >> 56]++;
+            p += 8;
+        }
+        while (p < end) lanes[0][*p++]++;
+
+        for (int c = 0; c < 256; ++c) {
+            hist[c] += static_cast<uint64_t>(lanes[0][c]) + lanes[1][c] + lanes[2][c] + lanes[3][c];
+        }
+        left -= n;
     }
-    return prob;
 }
 
-vector<SymbolInfo> buildShannonCodes(const map<unsigned char, double>& probabilities) {
-    vector<SymbolInfo> symbols;
-    for (const auto& pair : probabilities) {
-        symbols.push_back({ pair.first, pair.second, "" });
+Histogram buildHistogram(span<const unsigned char> data) {
+    Histogram hist{};
+    accumulateHistogram(data, hist);
+    return hist;
+}
+
+Probabilities probabilitiesFromHistogram(const Histogram& hist) {
+    uint64_t total = 0;
+    for (uint64_t count : hist) total += count;
+
+    Probabilities prob{};
+    for (int c = 0; c < 256; ++c) {
+        if (hist[c]) prob[c] = static_cast<double>(hist[c]) / total;
     }
+    return prob;
+}
 
+Probabilities calculateProbabilities(span<const unsigned char> data) {
+    return probabilitiesFromHistogram(buildHistogram(data));
+}
+
+// Replaces the codes of `symbols` by canonical codes for the same lengths:
+// ordered by (length, symbol), each code is the previous one plus one,
+// shifted left whenever the length grows. Any lengths satisfying the Kraft
+// inequality give a prefix-free code, and the decoder can rebuild it from
+// the lengths alone. The vector ends up in canonical order.
+void assignCanonicalCodes(vector<SymbolInfo>& symbols) {
     sort(symbols.begin(), symbols.end(), [](const SymbolInfo& a, const SymbolInfo& b) {
-        return a.probability > b.probability;
+        return a.length != b.length ? a.length < b.length : a.symbol < b.symbol;
+        });
+
+    uint64_t code = 0;
+    int prev_length = 0;
+    bool first = true;
+    for (auto& symbol : symbols) {
+        if (symbol.length == 0) continue;
+        if (!first) code++;
+        code <<= symbol.length - prev_length;
+        symbol.code = code;
+        prev_length = symbol.length;
+        first = false;
+    }
+}
+
+// Shannon code from raw counts using integer arithmetic only: symbols are
+// sorted by decreasing count, the length is the smallest l with
+// count * 2^l >= total, i.e. ceil(log2(total / count)), and the code is the
+// first l bits of the binary expansion of cumulative count / total, found
+// by exact long division. Results do not depend on floating-point rounding.
+// `symbols` is overwritten and keeps its capacity.
+void buildShannonCodes(const Histogram& hist, vector<SymbolInfo>& symbols, bool canonical = false) {
+    uint64_t total = 0;
+    for (uint64_t count : hist) total += count;
+
+    symbols.clear();
+    for (int c = 0; c < 256; ++c) {
+        if (hist[c]) {
+            symbols.push_back({ static_cast<unsigned char>(c), static_cast<double>(hist[c]) / total, 0, 0 });
+        }
+    }
+
+    // Ties stay in symbol order
+    sort(symbols.begin(), symbols.end(), [&hist](const SymbolInfo& a, const SymbolInfo& b) {
+        return hist[a.symbol] != hist[b.symbol] ? hist[a.symbol] > hist[b.symbol] : a.symbol < b.symbol;
         });
 
-    double sum = 0.0;
+    uint64_t cumulative = 0;
     for (auto& symbol : symbols) {
-        int code_length = ceil(log2(1.0 / symbol.probability));
-        double q = sum;
-        sum += symbol.probability;
+        uint64_t count = hist[symbol.symbol];
+        int code_length = 0;
+        while ((count << code_length) < total) code_length++;
 
-        string code;
+        uint64_t remainder = cumulative;
+        uint64_t code = 0;
         for (int i = 0; i < code_length; ++i) {
-            q *= 2;
-            code += (q >= 1.0) ? '1' : '0';
-            if (q >= 1.0) q -= 1.0;
+            remainder <<= 1;
+            uint64_t bit = remainder >= total;
+            if (bit) remainder -= total;
+            code = (code << 1) | bit;
         }
         symbol.code = code;
+        symbol.length = static_cast<uint8_t>(code_length);
+        cumulative += count;
     }
+
+    if (canonical) assignCanonicalCodes(symbols);
+}
+
+vector<SymbolInfo> buildShannonCodes(const Histogram& hist, bool canonical = false) {
+    vector<SymbolInfo> symbols;
+    buildShannonCodes(hist, symbols, canonical);
     return symbols;
 }
 
-void encodeFile(const string& inputFile, const string& outputFile) {
-    ifstream in(inputFile, ios::binary);
-    if (!in) {
-        cerr << "Error: Cannot open input file!" << endl;
-        return;
+// Caps the lengths of `symbols` at `max_length` (which must allow every
+// symbol a code: 2^max_length >= size) and restores the Kraft inequality by
+// lengthening the rarest codes first, where the extra bit costs least. Any
+// slack left is then spent shortening the most frequent codes. The vector is
+// reassigned canonical codes.
+void limitCodeLengths(vector<SymbolInfo>& symbols, const Histogram& hist, int max_length) {
+    if (symbols.size() < 2) return;
+
+    // Kraft sum in units of 2^-max_length
+    const uint64_t capacity = uint64_t(1) << max_length;
+    uint64_t kraft = 0;
+    for (auto& symbol : symbols) {
+        symbol.length = static_cast<uint8_t>(min<int>(max(1, int(symbol.length)), max_length));
+        kraft += uint64_t(1) << (max_length - symbol.length);
     }
 
-    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
-    in.close();
+    array<SymbolInfo*, 256> order;
+    auto by_count = span<SymbolInfo*>(order).first(symbols.size());
+    for (size_t i = 0; i < symbols.size(); ++i) by_count[i] = &symbols[i];
+    sort(by_count.begin(), by_count.end(), [&hist](const SymbolInfo* a, const SymbolInfo* b) {
+        return hist[a->symbol] != hist[b->symbol] ? hist[a->symbol] < hist[b->symbol] : a < b;
+        });
 
-    auto probabilities = calculateProbabilities(data);
-    auto codes = buildShannonCodes(probabilities);
-    map<unsigned char, string> code_map;
-    for (const auto& info : codes) {
-        code_map[info.symbol] = info.code;
+    while (kraft > capacity) {
+        for (SymbolInfo* symbol : by_count) {
+            if (kraft <= capacity) break;
+            if (symbol->length == max_length) continue;
+            kraft -= uint64_t(1) << (max_length - symbol->length - 1);
+            symbol->length++;
+        }
+    }
+    for (auto it = by_count.rbegin(); it != by_count.rend(); ++it) {
+        SymbolInfo* symbol = *it;
+        while (symbol->length > 1 && kraft + (uint64_t(1) << (max_length - symbol->length)) <= capacity) {
+            kraft += uint64_t(1) << (max_length - symbol->length);
+            symbol->length--;
+        }
     }
 
-    ofstream out(outputFile, ios::binary);
-    if (!out) {
-        cerr << "Error: Cannot create output file!" << endl;
-        return;
+    assignCanonicalCodes(symbols);
+}
+
+// Optimal prefix code with lengths limited to `max_length`, found by
+// package-merge. Level lists are built from the deepest level up: each is
+// the leaves merged with packages of adjacent pairs from the level below.
+// The first 2n - 2 items of the top list are the chosen coins; a leaf's
+// code length is the number of levels it is chosen on. Packages are formed
+// in order, so the first p packages in a list always come from the first
+// 2p items of the list below, and no back pointers are needed. Codes are
+// assigned canonically. `symbols` and `levels` are overwritten and keep
+// their capacity.
+struct HuffmanCoin {
+    uint64_t weight;
+    int leaf;   // index into the symbols, -1 for a package
+};
+
+void buildHuffmanCodes(const Histogram& hist, int max_length, vector<SymbolInfo>& symbols,
+    vector<vector<HuffmanCoin>>& levels) {
+    uint64_t total = 0;
+    symbols.clear();
+    for (int c = 0; c < 256; ++c) {
+        total += hist[c];
+        if (hist[c]) symbols.push_back({ static_cast<unsigned char>(c), 0.0, 0, 0 });
     }
+    for (auto& symbol : symbols) symbol.probability = static_cast<double>(hist[symbol.symbol]) / total;
+    if (symbols.size() < 2) return;
 
-    size_t symbol_count = codes.size();
-    out.write(reinterpret_cast<const char*>(&symbol_count), sizeof(symbol_count));
+    sort(symbols.begin(), symbols.end(), [&hist](const SymbolInfo& a, const SymbolInfo& b) {
+        return hist[a.symbol] != hist[b.symbol] ? hist[a.symbol] < hist[b.symbol] : a.symbol < b.symbol;
+        });
+
+    size_t n = symbols.size();
+    levels.resize(max(levels.size(), static_cast<size_t>(max_length)));
+    for (int level = max_length - 1; level >= 0; --level) {
+        // Packages are summed on the fly from pairs of the list below
+        const vector<HuffmanCoin>* below = level + 1 < max_length ? &levels[level + 1] : nullptr;
+        size_t package_count = below ? below->size() / 2 : 0;
+        auto& list = levels[level];
+        list.clear();
+        size_t leaf = 0, package = 0;
+        while (leaf < n || package < package_count) {
+            uint64_t package_weight = package < package_count
+                ? (*below)[2 * package].weight + (*below)[2 * package + 1].weight : 0;
+            if (package == package_count || (leaf < n && hist[symbols[leaf].symbol] <= package_weight)) {
+                list.push_back({ hist[symbols[leaf].symbol], static_cast<int>(leaf) });
+                leaf++;
+            }
+            else {
+                list.push_back({ package_weight, -1 });
+                package++;
+            }
+        }
+    }
+
+    size_t chosen = 2 * n - 2;
+    for (int level = 0; level < max_length && chosen > 0; ++level) {
+        size_t packages = 0;
+        for (size_t i = 0; i < chosen && i < levels[level].size(); ++i) {
+            if (levels[level][i].leaf >= 0) symbols[levels[level][i].leaf].length++;
+            else packages++;
+        }
+        chosen = 2 * packages;
+    }
+
+    assignCanonicalCodes(symbols);
+}
+
+vector<SymbolInfo> buildHuffmanCodes(const Histogram& hist, int max_length) {
+    vector<SymbolInfo> symbols;
+    vector<vector<HuffmanCoin>> levels;
+    buildHuffmanCodes(hist, max_length, symbols, levels);
+    return symbols;
+}
+
+// Direct byte -> code lookup for the encoder hot loop
+struct CodeWord {
+    uint64_t bits;
+    uint8_t length;
+};
+
+using CodeTable = array<CodeWord, 256>;
 
+CodeTable makeCodeTable(const vector<SymbolInfo>& codes) {
+    CodeTable table{};
     for (const auto& info : codes) {
-        out.put(info.symbol);
-        uint8_t code_length = info.code.size();
-        out.put(code_length);
+        table[info.symbol] = { info.code, info.length };
+    }
+    return table;
+}
 
-        // Pack code bits into bytes
-        unsigned char buffer = 0;
-        int bit_pos = 0;
-        for (char bit : info.code) {
-            if (bit == '1') {
-                buffer |= (1 << (7 - bit_pos));
-            }
-            bit_pos++;
+#ifdef SHANNON_BMI2
+bool hasBmi2() {
+    static const bool supported = __builtin_cpu_supports("bmi2");
+    return supported;
+}
+#endif
 
-            if (bit_pos == 8) {
-                out.put(buffer);
-                buffer = 0;
-                bit_pos = 0;
-            }
+// Length of the longest code, 0 for a lone zero-length code
+int longestCode(const vector<SymbolInfo>& codes) {
+    int longest = 0;
+    for (const auto& info : codes) longest = max(longest, static_cast<int>(info.length));
+    return longest;
+}
+
+// MSB-first bit writer appending to a byte vector. Whole codes are ORed
+// into a 64-bit accumulator and only full words are stored.
+class BitWriter {
+public:
+    explicit BitWriter(vector<unsigned char>& output) : out(output), used(output.size()) {}
+
+    // Appends the low `length` bits of `bits` (length <= 64)
+    void write(uint64_t bits, int length) {
+        if (length == 0) return;
+        if (length < 64) bits &= (uint64_t(1) << length) - 1;
+        int free_bits = 64 - acc_bits;
+        if (length < free_bits) {
+            acc |= bits << (free_bits - length);
+            acc_bits += length;
+            return;
+        }
+        int spill = length - free_bits;
+        acc |= bits >> spill;
+        putWord(acc);
+        acc = spill ? bits << (64 - spill) : 0;
+        acc_bits = spill;
+    }
+
+    void write(const CodeWord& code) { write(code.bits, code.length); }
+
+    // Writes the code of every symbol. `longest` selects a kernel that knows
+    // how many codes fit between two stores, so its loop has no spill checks.
+    void writeSymbols(span<const unsigned char> symbols, const CodeTable& table, int longest) {
+        if (longest <= 0 || longest > 28) {
+            for (unsigned char c : symbols) write(table[c]);
+        }
+        else if (longest <= 8) writeSymbolsUpTo<8>(symbols, table);
+        else if (longest <= 11) writeSymbolsUpTo<11>(symbols, table);
+        else if (longest <= 14) writeSymbolsUpTo<14>(symbols, table);
+        else if (longest <= 18) writeSymbolsUpTo<18>(symbols, table);
+        else writeSymbolsUpTo<28>(symbols, table);
+    }
+
+    // Pads with zero bits up to the next byte boundary
+    void alignToByte() {
+        acc_bits = (acc_bits + 7) & ~7;
+        if (acc_bits == 64) {
+            putWord(acc);
+            acc = 0;
+            acc_bits = 0;
+        }
+    }
+
+    // Stores the partial word and trims the vector; output ends on a byte boundary
+    void finish() {
+        alignToByte();
+        reserve(8);
+        for (int i = 0; i < acc_bits; i += 8) {
+            out[used++] = static_cast<unsigned char>(acc >> (56 - i));
         }
-        // Write remaining bits if any
-        if (bit_pos > 0) {
-            out.put(buffer);
+        acc = 0;
+        acc_bits = 0;
+        out.resize(used);
+    }
+
+private:
+    vector<unsigned char>& out;
+    size_t used;
+    uint64_t acc = 0;
+    int acc_bits = 0;
+
+    void reserve(size_t bytes) {
+        if (out.size() - used < bytes) out.resize(max(out.size() * 2, used + max<size_t>(bytes, 1 << 16)));
+    }
+
+    void putWord(uint64_t word) {
+        reserve(8);
+        for (int i = 0; i < 8; ++i) {
+            out[used + i] = static_cast<unsigned char>(word >> (56 - 8 * i));
         }
+        used += 8;
+    }
+
+    template <int MAX>
+    void writeSymbolsUpTo(span<const unsigned char> symbols, const CodeTable& table) {
+#ifdef SHANNON_BMI2
+        if (hasBmi2()) return writeFixedBmi2<MAX>(symbols, table);
+#endif
+        writeFixedScalar<MAX>(symbols, table);
+    }
+
+    template <int MAX>
+    SHANNON_FLATTEN void writeFixedScalar(span<const unsigned char> symbols, const CodeTable& table) {
+        writeFixed<MAX>(symbols, table);
+    }
+
+#ifdef SHANNON_BMI2
+    template <int MAX>
+    __attribute__((target("bmi2"), flatten)) void writeFixedBmi2(span<const unsigned char> symbols, const CodeTable& table) {
+        writeFixed<MAX>(symbols, table);
     }
+#endif
 
-    unsigned char buffer = 0;
-    int bit_pos = 0;
-    for (unsigned char c : data) {
-        const string& code = code_map[c];
-        for (char bit : code) {
-            if (bit == '1') {
-                buffer |= (1 << (7 - bit_pos));
+    // Codes of at most MAX (>= 1) bits. After a store at most 7 bits stay in
+    // the accumulator, so 56 / MAX codes always fit before the next one; the
+    // store is a whole word of which only the complete bytes are kept.
+    template <int MAX>
+    void writeFixed(span<const unsigned char> symbols, const CodeTable& table) {
+        constexpr size_t per_store = 56 / MAX;
+        while (acc_bits >= 8) {
+            reserve(1);
+            out[used++] = static_cast<unsigned char>(acc >> 56);
+            acc <<= 8;
+            acc_bits -= 8;
+        }
+        reserve(symbols.size() * MAX / 8 + 16);
+        unsigned char* dst = out.data() + used;
+        size_t i = 0;
+        for (; symbols.size() - i >= per_store; i += per_store) {
+            for (size_t k = 0; k < per_store; ++k) {
+                const CodeWord& code = table[symbols[i + k]];
+                acc_bits += code.length;
+                acc |= code.bits << (64 - acc_bits);
             }
-            bit_pos++;
+            for (int b = 0; b < 8; ++b) dst[b] = static_cast<unsigned char>(acc >> (56 - 8 * b));
+            int bytes = acc_bits >> 3;
+            dst += bytes;
+            acc <<= bytes * 8;
+            acc_bits &= 7;
+        }
+        used = static_cast<size_t>(dst - out.data());
+        for (; i < symbols.size(); ++i) write(table[symbols[i]]);
+    }
+};
+
+// MSB-first bit reader over an in-memory buffer. Bits are kept left-aligned
+// in a 64-bit window so a table probe is a single shift.
+class BitReader {
+public:
+    BitReader(const unsigned char* data, size_t size)
+        : cur(data), end(data + size), bits_left(static_cast<uint64_t>(size) * 8) {}
+    BitReader() : BitReader(nullptr, 0) {}
 
-            if (bit_pos == 8) {
-                out.put(buffer);
-                buffer = 0;
-                bit_pos = 0;
+    void refill() {
+        if (end - cur >= 8) {
+            uint64_t word = 0;
+            for (int i = 0; i < 8; ++i) word = (word << 8) | cur[i];
+            window |= word >> window_bits;
+            int bytes = (63 - window_bits) >> 3;
+            cur += bytes;
+            window_bits += bytes * 8;
+        }
+        else {
+            while (window_bits <= 56 && cur < end) {
+                window |= static_cast<uint64_t>(*cur++) << (56 - window_bits);
+                window_bits += 8;
             }
         }
     }
 
-    // Write remaining bits if any
-    if (bit_pos > 0) {
-        out.put(buffer);
+    // Returns the next n bits (1..32); past the end of input they read as zero.
+    uint32_t peek(int n) const { return static_cast<uint32_t>(window >> (64 - n)); }
+
+    void consume(int n) {
+        window <<= n;
+        window_bits -= n;
+        bits_left -= n;
     }
 
-    out.close();
+    // Reads an n-bit field (n <= 64); fails instead of reading past the end
+    bool read(int n, uint64_t& value) {
+        if (bits_left < static_cast<uint64_t>(n)) return false;
+        value = 0;
+        while (n > 0) {
+            int part = min(n, 32);
+            refill();
+            value = (value << part) | peek(part);
+            consume(part);
+            n -= part;
+        }
+        return true;
+    }
 
-    ifstream orig(inputFile, ios::ate | ios::binary);
-    ifstream comp(outputFile, ios::ate | ios::binary);
-    size_t original_size = orig.tellg();
-    size_t compressed_size = comp.tellg();
-    orig.close();
-    comp.close();
+    uint64_t remaining() const { return bits_left; }
 
-    cout << "File successfully encoded." << endl;
-    cout << "Original size: " << original_size << " bytes" << endl;
-    cout << "Compressed size: " << compressed_size << " bytes" << endl;
-    cout << "Compression ratio: " << (compressed_size * 100 / original_size) << "%" << endl;
-}
+private:
+    const unsigned char* cur;
+    const unsigned char* end;
+    uint64_t window = 0;
+    int window_bits = 0;
+    uint64_t bits_left;
+};
 
-void decodeFile(const string& inputFile, const string& outputFile) {
-    ifstream in(inputFile, ios::binary);
-    if (!in) {
-        cerr << "Error: Cannot open input file!" << endl;
-        return;
+// Multi-level lookup table: the root is indexed by the next ROOT_BITS bits,
+// codes longer than that continue in subtables indexed by the following bits.
+struct DecodeEntry {
+    unsigned char symbol;
+    uint8_t length;   // bits consumed at this level by a leaf
+    uint16_t link;    // LEAF, HOLE or a subtable index
+};
+
+class DecodeTable {
+public:
+    static constexpr int ROOT_BITS = 11;
+    static constexpr uint16_t LEAF = 0xFFFF;
+    static constexpr uint16_t HOLE = 0xFFFE;
+
+    // A lone zero-length code makes a table that yields its symbol without
+    // consuming input; other zero-length codes are rejected.
+    bool build(const vector<SymbolInfo>& codes) {
+        entries.clear();
+        subtables.clear();
+        int longest = 0;
+        size_t start[MAX_CODE_LENGTH + 2] = {};
+        for (const auto& info : codes) {
+            if (info.length > MAX_CODE_LENGTH || (info.length == 0 && codes.size() != 1)) return false;
+            longest = max(longest, static_cast<int>(info.length));
+            start[MAX_CODE_LENGTH - info.length + 1]++;
+        }
+        // Longest first: a shorter code written later wins over anything it is a
+        // prefix of, which is what the bit-at-a-time matcher did. A counting
+        // sort keeps equal lengths in input order.
+        for (int i = 1; i <= MAX_CODE_LENGTH + 1; ++i) start[i] += start[i - 1];
+        items.resize(codes.size());
+        for (const auto& info : codes) {
+            uint64_t mask = (info.length == 64) ? ~uint64_t(0) : (uint64_t(1) << info.length) - 1;
+            items[start[MAX_CODE_LENGTH - info.length]++] = { info.code & mask, info.length, info.symbol };
+        }
+        root_bits = max(1, min(longest, ROOT_BITS));
+        buildLevel(items, 0, root_bits);
+        return true;
     }
 
-    size_t symbol_count;
-    in.read(reinterpret_cast<char*>(&symbol_count), sizeof(symbol_count));
+    // Decodes one symbol. Fails on a hole or when the code would run past the
+    // end of input.
+    bool decodeSymbol(BitReader& reader, unsigned char& symbol) const {
+        reader.refill();
+        const DecodeEntry* entry = &entries[reader.peek(root_bits)];
+        if (entry->link != LEAF) {
+            if (entry->link == HOLE || reader.remaining() < static_cast<uint64_t>(root_bits)) return false;
+            reader.consume(root_bits);
+            entry = decodeLong(reader, entry->link);
+            if (!entry) return false;
+        }
+        if (reader.remaining() < entry->length) return false;
+        symbol = entry->symbol;
+        reader.consume(entry->length);
+        return true;
+    }
 
-    vector<SymbolInfo> codes;
-    map<string, unsigned char> decode_map;
-    for (size_t i = 0; i < symbol_count; ++i) {
-        SymbolInfo info;
-        info.symbol = in.get();
-        uint8_t code_length = in.get();
-
-        string code_str;
-        int bits_read = 0;
-        while (bits_read < code_length) {
-            unsigned char byte = in.get();
-            for (int j = 7; j >= 0 && bits_read < code_length; j--, bits_read++) {
-                if (byte & (1 << j)) {
-                    code_str += '1';
-                }
-                else {
-                    code_str += '0';
+    // Decodes whole codes that fit into the remaining input bits, at most
+    // `capacity` of them. A short count means the stream is exhausted.
+    size_t decode(BitReader& reader, unsigned char* output, size_t capacity) const {
+        size_t produced = 0;
+        if (subtables.empty()) {
+            bool holes = false;
+            produced = flatRounds<1>(&reader, &output, capacity, holes);
+            if (holes) return produced;
+        }
+        while (produced < capacity && decodeSymbol(reader, output[produced])) produced++;
+        return produced;
+    }
+
+    // Decodes `count` symbols from each reader in turn. The streams do not
+    // depend on each other, so their lookups overlap in the pipeline.
+    template <size_t N>
+    bool decodeInterleaved(BitReader (&readers)[N], unsigned char* const (&outputs)[N], size_t count) const {
+        size_t i = 0;
+        if (subtables.empty()) {
+            bool holes = false;
+            i = flatRounds<N>(readers, outputs, count, holes);
+            if (holes) return false;
+        }
+        for (; i < count; ++i) {
+            bool ok = true;
+            for (size_t s = 0; s < N; ++s) ok &= decodeSymbol(readers[s], outputs[s][i]);
+            if (!ok) return false;
+        }
+        return true;
+    }
+
+    // Occurrences in `hist` of symbols whose codes are longer than the root
+    // table, each of which costs a subtable walk
+    uint64_t misses(const Histogram& hist) const {
+        uint64_t count = 0;
+        for (const auto& item : items) {
+            if (item.length > root_bits) count += hist[item.symbol];
+        }
+        return count;
+    }
+
+private:
+    struct Item {
+        uint64_t bits;
+        uint8_t length;
+        unsigned char symbol;
+    };
+
+    struct Subtable {
+        uint32_t offset;
+        uint8_t bits;
+    };
+
+    vector<DecodeEntry> entries;
+    vector<Subtable> subtables;
+    vector<Item> items;     // kept so rebuilding a table reuses the storage
+    int root_bits = ROOT_BITS;
+
+    using RoundsKernel = size_t (*)(const DecodeEntry*, BitReader*, unsigned char* const*, size_t, bool&);
+
+    // Whole rounds of a table without subtables, decoded by the kernel
+    // compiled for its root width
+    template <size_t N>
+    size_t flatRounds(BitReader* readers, unsigned char* const* outputs, size_t count, bool& holes) const {
+        static const auto kernels = roundsKernels<N>(make_index_sequence<ROOT_BITS>());
+        return kernels[root_bits - 1](entries.data(), readers, outputs, count, holes);
+    }
+
+    template <size_t N, size_t... WIDTH>
+    static array<RoundsKernel, sizeof...(WIDTH)> roundsKernels(index_sequence<WIDTH...>) {
+#ifdef SHANNON_BMI2
+        if (hasBmi2()) return { &decodeRoundsBmi2<int(WIDTH) + 1, N>... };
+#endif
+        return { &decodeRoundsScalar<int(WIDTH) + 1, N>... };
+    }
+
+    template <int ROOT, size_t N>
+    SHANNON_FLATTEN static size_t decodeRoundsScalar(const DecodeEntry* entries, BitReader* readers,
+        unsigned char* const* outputs, size_t count, bool& holes) {
+        return decodeRounds<ROOT, N>(entries, readers, outputs, count, holes);
+    }
+
+#ifdef SHANNON_BMI2
+    template <int ROOT, size_t N>
+    __attribute__((target("bmi2"), flatten)) static size_t decodeRoundsBmi2(const DecodeEntry* entries,
+        BitReader* readers, unsigned char* const* outputs, size_t count, bool& holes) {
+        return decodeRounds<ROOT, N>(entries, readers, outputs, count, holes);
+    }
+#endif
+
+    // Every code resolves in a root of ROOT bits, so a refill covers 56 / ROOT
+    // symbols of each stream, the shifts are constants and a round needs no
+    // per-symbol checks. A hole has length 0 and is caught after its round.
+    // Returns the symbols decoded per stream, stopping when a stream has
+    // fewer bits left than a round may take. The readers are worked on as
+    // locals: the byte stores could alias them otherwise and keep them out
+    // of registers.
+    template <int ROOT, size_t N>
+    static size_t decodeRounds(const DecodeEntry* entries, BitReader* streams, unsigned char* const* outputs,
+        size_t count, bool& holes) {
+        constexpr size_t per_refill = 56 / ROOT;
+        constexpr uint64_t round_bits = per_refill * ROOT;
+        BitReader readers[N];
+        for (size_t s = 0; s < N; ++s) readers[s] = streams[s];
+        size_t i = 0;
+        while (count - i >= per_refill) {
+            bool enough = true;
+            for (size_t s = 0; s < N; ++s) enough &= readers[s].remaining() >= round_bits;
+            if (!enough) break;
+            for (size_t s = 0; s < N; ++s) readers[s].refill();
+            for (size_t k = 0; k < per_refill; ++k) {
+                for (size_t s = 0; s < N; ++s) {
+                    const DecodeEntry& entry = entries[readers[s].peek(ROOT)];
+                    holes |= entry.link != LEAF;
+                    outputs[s][i + k] = entry.symbol;
+                    readers[s].consume(entry.length);
                 }
             }
+            if (holes) break;
+            i += per_refill;
         }
-        info.code = code_str;
-        decode_map[code_str] = info.symbol;
+        for (size_t s = 0; s < N; ++s) streams[s] = readers[s];
+        return i;
     }
 
-    ofstream out(outputFile, ios::binary);
-    if (!out) {
-        cerr << "Error: Cannot create output file!" << endl;
-        return;
+    // Walks subtables until a leaf is found; returns nullptr on a hole or when
+    // the code would run past the end of input.
+    const DecodeEntry* decodeLong(BitReader& reader, uint16_t link) const {
+        while (true) {
+            const Subtable& sub = subtables[link];
+            reader.refill();
+            const DecodeEntry* entry = &entries[sub.offset + reader.peek(sub.bits)];
+            if (entry->link == LEAF) return entry;
+            if (entry->link == HOLE || reader.remaining() < sub.bits) return nullptr;
+            reader.consume(sub.bits);
+            link = entry->link;
+        }
     }
 
-    string current_code;
-    unsigned char byte;
-    while (in.get(reinterpret_cast<char&>(byte))) {
-        for (int i = 7; i >= 0; --i) {
-            char bit = (byte & (1 << i)) ? '1' : '0';
-            current_code += bit;
+    // Fills a table of 2^bits entries for codes whose first `depth` bits are
+    // already consumed. Items are sorted by descending length.
+    uint32_t buildLevel(const vector<Item>& level_items, int depth, int bits) {
+        uint32_t offset = static_cast<uint32_t>(entries.size());
+        entries.resize(entries.size() + (size_t(1) << bits), DecodeEntry{ 0, 0, HOLE });
+
+        // Group codes that do not fit this level by their index bits
+        map<uint32_t, vector<Item>> groups;
+        for (const auto& item : level_items) {
+            if (item.length - depth > bits) {
+                uint32_t index = static_cast<uint32_t>((item.bits >> (item.length - depth - bits)) & ((1u << bits) - 1));
+                groups[index].push_back(item);
+            }
+        }
+        for (auto& group : groups) {
+            int longest = group.second.front().length - depth - bits;
+            int sub_bits = min(longest, ROOT_BITS);
+            uint16_t link = static_cast<uint16_t>(subtables.size());
+            subtables.push_back({ 0, static_cast<uint8_t>(sub_bits) });
+            uint32_t sub_offset = buildLevel(group.second, depth + bits, sub_bits);
+            subtables[link].offset = sub_offset;
+            entries[offset + group.first] = DecodeEntry{ 0, 0, link };
+        }
 
-            auto it = decode_map.find(current_code);
-            if (it != decode_map.end()) {
-                out.put(it->second);
-                current_code.clear();
+        for (const auto& item : level_items) {
+            int rest = item.length - depth;
+            if (rest > bits) continue;
+            uint32_t first = static_cast<uint32_t>(item.bits & ((uint64_t(1) << rest) - 1)) << (bits - rest);
+            uint32_t count = 1u << (bits - rest);
+            for (uint32_t i = 0; i < count; ++i) {
+                entries[offset + first + i] = DecodeEntry{ item.symbol, static_cast<uint8_t>(rest), LEAF };
             }
         }
+        return offset;
     }
+};
 
-    out.close();
-    cout << "File successfully decoded." << endl;
+// Container layout (sizes are LEB128 varints):
+//   stream header: "SHNC", version, flags, nominal block size (no more
+//                  than the input when that is a single block), with
+//                  FLAG_ORIGINAL_SIZE the total uncompressed size and with
+//                  FLAG_DICTIONARY the ID of the shared dictionary
+//   block:         mode, raw size, body size, body, with FLAG_BLOCK_CHECKSUM
+//                  the CRC32C of the raw block (4 bytes little-endian)
+//   end marker:    mode BLOCK_END, with FLAG_STREAM_CHECKSUM the CRC32C of
+//                  all raw bytes
+//   block index:   block count, then stored size and raw size per block
+//   trailer:       index offset (8 bytes little-endian), "SHNX"
+// Every block body carries its own code table followed by the payload, so
+// blocks can be coded and decoded independently; only BLOCK_DICTIONARY
+// bodies are the bare payload coded with the shared dictionary. The index and trailer are
+// present when FLAG_BLOCK_INDEX is set and let a reader find all blocks
+// from the end of the file.
+constexpr unsigned char CONTAINER_MAGIC[4] = { 'S', 'H', 'N', 'C' };
+constexpr uint8_t FORMAT_VERSION = 2;
+constexpr uint64_t MAX_BLOCK_SIZE = uint64_t(1) << 30;
+constexpr unsigned char TRAILER_MAGIC[4] = { 'S', 'H', 'N', 'X' };
+constexpr size_t TRAILER_SIZE = 8 + sizeof(TRAILER_MAGIC);
+// A mode byte and two one-byte varints
+constexpr size_t MIN_BLOCK_HEADER_SIZE = 3;
+
+enum StreamFlags : uint8_t {
+    FLAG_BLOCK_INDEX = 0x01,
+    FLAG_ORIGINAL_SIZE = 0x02,
+    FLAG_DICTIONARY = 0x04,
+    FLAG_BLOCK_CHECKSUM = 0x08,
+    FLAG_STREAM_CHECKSUM = 0x10,
+};
+constexpr uint8_t KNOWN_FLAGS = 0x1F;
+constexpr size_t CHECKSUM_SIZE = 4;
+
+// Streaming encoders do not know the input size when the header goes out
+constexpr uint64_t UNKNOWN_SIZE = ~uint64_t(0);
+
+enum BlockMode : uint8_t {
+    BLOCK_END = 0,
+    BLOCK_SHANNON = 1,
+    BLOCK_ORDER1 = 2,
+    BLOCK_STORED = 3,
+    BLOCK_HUFFMAN = 4,
+    BLOCK_RANS = 5,
+    BLOCK_DICTIONARY = 6,
+    BLOCK_INTERLEAVED = 7,
+    BLOCK_RUN = 8,
+    BLOCK_TRANSFORMED = 9,
+};
+
+// Interleaved blocks carry a prefix code table and then the block split into
+// STREAM_COUNT equal parts, each its own byte-aligned bitstream, so the
+// decoder can follow all of them at once. After the table come the byte sizes
+// of all streams but the last. Smaller blocks gain nothing from the split.
+constexpr int STREAM_COUNT = 4;
+constexpr size_t MIN_INTERLEAVED_SIZE = 4096;
+
+// A transformed block's body is the Transform bits applied, with
+// TRANSFORM_BWT the primary index, then a complete inner block (header and
+// body, never itself transformed) holding the transformed bytes.
+//
+// A block of one repeated byte is a run: the body is that byte. Blocks below
+// TINY_BLOCK_SIZE are stored as soon as the histogram shows that no prefix
+// code can pay for its table; the order-1 context map alone is larger than
+// such a block.
+constexpr size_t TINY_BLOCK_SIZE = 32;
+
+// Code tables carry lengths only and the codes are rebuilt canonically.
+// After one flag bit a table is either sparse (count - 1, then symbol and
+// length per entry) or dense (a 256-bit presence map, then the lengths of
+// the present symbols in symbol order), whichever is smaller.
+constexpr int TABLE_LENGTH_BITS = 5;
+// Blocks are at most 2^30 bytes, so Shannon lengths never exceed 30
+static_assert(MAX_TABLE_CODE_LENGTH == (1 << TABLE_LENGTH_BITS) - 1);
+static_assert(DEFAULT_MAX_CODE_LENGTH == DecodeTable::ROOT_BITS);
+
+}  // namespace detail
+
+using namespace detail;
+
+// Asked once: the query reads sysfs on Linux, which would dominate coding
+// a tiny buffer
+unsigned defaultThreadCount() {
+    static const unsigned count = max(1u, thread::hardware_concurrency());
+    return count;
+}
+
+void CodingStats::add(const CodingStats& other) {
+    read_seconds += other.read_seconds;
+    histogram_seconds += other.histogram_seconds;
+    table_seconds += other.table_seconds;
+    code_seconds += other.code_seconds;
+    transform_seconds += other.transform_seconds;
+    verify_seconds += other.verify_seconds;
+    write_seconds += other.write_seconds;
+    raw_bytes += other.raw_bytes;
+    container_bytes += other.container_bytes;
+    stored_bytes += other.stored_bytes;
+    symbols += other.symbols;
+    payload_bits += other.payload_bits;
+    table_bits += other.table_bits;
+    entropy_bits += other.entropy_bits;
+    table_lookups += other.table_lookups;
+    table_misses += other.table_misses;
 }
 
-int main() {
-    cout << "Enter '1' to compress or '2' to decompress: ";
+namespace detail {
 
-    int choice;
-    cin >> choice;
-    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+using Clock = chrono::steady_clock;
 
-    cout << "Enter filename (exp.txt to compress | encode.txt to decompress): ";
-    string filename;
-    getline(cin, filename);
+// Seconds since `mark`, which moves on to now
+double lap(Clock::time_point& mark) {
+    Clock::time_point now = Clock::now();
+    double seconds = chrono::duration<double>(now - mark).count();
+    mark = now;
+    return seconds;
+}
 
-    if (choice == 1) {
-        string output = "encode.txt";
-        encodeFile(filename, output);
+double entropyBits(const Histogram& hist) {
+    uint64_t total = 0;
+    for (uint64_t count : hist) total += count;
+    double bits = 0;
+    for (uint64_t count : hist) {
+        if (count) bits += count * log2(static_cast<double>(total) / count);
     }
-    else if (choice == 2) {
-        string output = "decode.txt";
-        decodeFile(filename, output);
+    return bits;
+}
+
+void putVarint(vector<unsigned char>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
     }
-    else {
-        cerr << "Error: Invalid choice!" << endl;
-        return 1;
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+bool getVarint(span<const unsigned char> data, size_t& pos, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < data.size(); shift += 7) {
+        unsigned char byte = data[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+void putFixed32(vector<unsigned char>& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+}
+
+uint32_t getFixed32(const unsigned char* data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | static_cast<uint32_t>(data[3]) << 24;
+}
+
+// CRC32C (Castagnoli), the CRC computed by the SSE4.2 crc32 instruction.
+// Values are bit-reflected, so x^0 is the top bit.
+constexpr uint32_t CRC32C_POLY = 0x82F63B78;
+
+// Slicing-by-8 tables for CPUs without the instruction
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; ++k) crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            table[0][i] = crc;
+        }
+        for (int t = 1; t < 8; ++t) {
+            for (int i = 0; i < 256; ++i) table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+        }
+    }
+};
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t size) {
+    static const Crc32cTables tables;
+    const auto& t = tables.table;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t low = crc ^ getFixed32(data);
+        uint32_t high = getFixed32(data + 4);
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24]
+            ^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+    }
+    for (; size > 0; ++data, --size) crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+    return crc;
+}
+
+#ifdef SHANNON_X86
+#ifdef __GNUC__
+__attribute__((target("sse4.2")))
+#endif
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+    uint64_t value = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+    crc = static_cast<uint32_t>(value);
+    for (; size > 0; ++data, --size) crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+
+bool hasCrc32Instruction() {
+#ifdef __GNUC__
+    return __builtin_cpu_supports("sse4.2");
+#else
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 20) & 1;
+#endif
+}
+#endif
+
+// Checksum of `data` following on from the checksum `crc` of earlier bytes
+uint32_t crc32c(span<const unsigned char> data, uint32_t crc = 0) {
+#ifdef SHANNON_X86
+    static const bool hardware = hasCrc32Instruction();
+    if (hardware) return ~crc32cHardware(~crc, data.data(), data.size());
+#endif
+    return ~crc32cSoftware(~crc, data.data(), data.size());
+}
+
+// a * b modulo the polynomial
+uint32_t crcMultiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit; bit >>= 1) {
+        if (a & bit) product ^= b;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// Checksum of two concatenated parts from the checksums of each, as zlib's
+// crc32_combine: the first is carried past the second by multiplying with
+// x^(8 * second_size), built from squarings of x
+uint32_t crc32cCombine(uint32_t first, uint32_t second, uint64_t second_size) {
+    static const auto powers = [] {
+        array<uint32_t, 64> table{};
+        table[0] = 1u << 30;    // x^1
+        for (int k = 1; k < 64; ++k) table[k] = crcMultiply(table[k - 1], table[k - 1]);
+        return table;
+    }();
+    uint32_t shift = 1u << 31;  // x^0
+    for (int k = 3; second_size; second_size >>= 1, ++k) {
+        if (second_size & 1) shift = crcMultiply(powers[k], shift);
     }
+    return crcMultiply(shift, first) ^ second;
+}
+
+bool isContainer(span<const unsigned char> data) {
+    return data.size() >= sizeof(CONTAINER_MAGIC) && memcmp(data.data(), CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) == 0;
+}
 
-    return 0;
+uint64_t sparseTableBits(size_t count) { return 1 + 8 + count * (8 + TABLE_LENGTH_BITS); }
+uint64_t denseTableBits(size_t count) { return 1 + 256 + count * TABLE_LENGTH_BITS; }
+
+uint64_t codeTableBits(const vector<SymbolInfo>& codes) {
+    return min(sparseTableBits(codes.size()), denseTableBits(codes.size()));
 }
+
+void writeCodeTable(BitWriter& writer, const vector<SymbolInfo>& codes) {
+    if (sparseTableBits(codes.size()) <= denseTableBits(codes.size())) {
+        writer.write(0, 1);
+        writer.write(codes.size() - 1, 8);
+        for (const auto& info : codes) {
+            writer.write(info.symbol, 8);
+            writer.write(info.length, TABLE_LENGTH_BITS);
+        }
+        return;
+    }
+
+    array<int, 256> lengths;
+    lengths.fill(-1);
+    for (const auto& info : codes) lengths[info.symbol] = info.length;
+    writer.write(1, 1);
+    for (int c = 0; c < 256; ++c) writer.write(lengths[c] >= 0 ? 1 : 0, 1);
+    for (int c = 0; c < 256; ++c) {
+        if (lengths[c] >= 0) writer.write(lengths[c], TABLE_LENGTH_BITS);
+    }
+}
+
+// Reads the lengths, checks they form a usable prefix code (Kraft sum at
+// most one, zero length only for a lone symbol) and assigns canonical codes
+bool readCodeTable(BitReader& reader, vector<SymbolInfo>& codes) {
+    uint64_t dense, value;
+    if (!reader.read(1, dense)) return false;
+    codes.clear();
+    if (!dense) {
+        uint64_t count;
+        if (!reader.read(8, count)) return false;
+        for (uint64_t i = 0; i <= count; ++i) {
+            uint64_t symbol;
+            if (!reader.read(8, symbol) || !reader.read(TABLE_LENGTH_BITS, value)) return false;
+            codes.push_back({ static_cast<unsigned char>(symbol), 0.0, 0, static_cast<uint8_t>(value) });
+        }
+    }
+    else {
+        uint64_t present[4] = {};
+        for (int c = 0; c < 256; ++c) {
+            if (!reader.read(1, value)) return false;
+            present[c / 64] |= value << (c % 64);
+        }
+        for (int c = 0; c < 256; ++c) {
+            if (!((present[c / 64] >> (c % 64)) & 1)) continue;
+            if (!reader.read(TABLE_LENGTH_BITS, value)) return false;
+            codes.push_back({ static_cast<unsigned char>(c), 0.0, 0, static_cast<uint8_t>(value) });
+        }
+    }
+
+    uint64_t kraft = 0;
+    for (const auto& info : codes) {
+        if (info.length == 0) {
+            if (codes.size() != 1) return false;
+            continue;
+        }
+        kraft += uint64_t(1) << (MAX_TABLE_CODE_LENGTH - info.length);
+    }
+    if (codes.empty() || kraft > (uint64_t(1) << MAX_TABLE_CODE_LENGTH)) return false;
+
+    assignCanonicalCodes(codes);
+    return true;
+}
+
+uint64_t payloadBits(const vector<SymbolInfo>& codes, const Histogram& hist) {
+    uint64_t bits = 0;
+    for (const auto& info : codes) bits += hist[info.symbol] * info.length;
+    return bits;
+}
+
+// Dictionary file: "SHND", the ID (4 bytes little-endian), then the lengths
+// in the code table format, padded to a byte. The ID is a hash of the
+// lengths, so equal tables get equal IDs and a damaged file is noticed.
+constexpr unsigned char DICTIONARY_MAGIC[4] = { 'S', 'H', 'N', 'D' };
+
+uint32_t dictionaryId(const array<uint8_t, 256>& lengths) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint8_t length : lengths) hash = (hash ^ length) * 16777619u;
+    return hash;
+}
+
+void dictionaryCodes(const Dictionary& dictionary, vector<SymbolInfo>& codes) {
+    codes.clear();
+    for (int c = 0; c < 256; ++c) {
+        codes.push_back({ static_cast<unsigned char>(c), 0.0, 0, dictionary.lengths[c] });
+    }
+    assignCanonicalCodes(codes);
+}
+
+vector<SymbolInfo> dictionaryCodes(const Dictionary& dictionary) {
+    vector<SymbolInfo> codes;
+    dictionaryCodes(dictionary, codes);
+    return codes;
+}
+
+}  // namespace detail
+
+Dictionary trainDictionary(const vector<span<const uint8_t>>& samples, int max_code_length) {
+    Histogram hist{};
+    for (auto sample : samples) accumulateHistogram(sample, hist);
+    for (auto& count : hist) count++;
+
+    Dictionary dictionary;
+    for (const auto& info : buildHuffmanCodes(hist, clamp(max_code_length, MIN_CODE_LENGTH_LIMIT, MAX_TABLE_CODE_LENGTH))) {
+        dictionary.lengths[info.symbol] = info.length;
+    }
+    dictionary.id = dictionaryId(dictionary.lengths);
+    return dictionary;
+}
+
+bool saveDictionary(const string& path, const Dictionary& dictionary) {
+    vector<unsigned char> bytes(DICTIONARY_MAGIC, DICTIONARY_MAGIC + sizeof(DICTIONARY_MAGIC));
+    for (int i = 0; i < 4; ++i) bytes.push_back(static_cast<unsigned char>(dictionary.id >> (8 * i)));
+    BitWriter writer(bytes);
+    writeCodeTable(writer, dictionaryCodes(dictionary));
+    writer.finish();
+
+    ofstream out(path, ios::binary);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return static_cast<bool>(out);
+}
+
+bool loadDictionary(const string& path, Dictionary& dictionary) {
+    ifstream in(path, ios::binary);
+    vector<unsigned char> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    constexpr size_t prefix = sizeof(DICTIONARY_MAGIC) + 4;
+    if (bytes.size() < prefix || memcmp(bytes.data(), DICTIONARY_MAGIC, sizeof(DICTIONARY_MAGIC)) != 0) return false;
+
+    dictionary.id = 0;
+    for (int i = 0; i < 4; ++i) dictionary.id |= static_cast<uint32_t>(bytes[sizeof(DICTIONARY_MAGIC) + i]) << (8 * i);
+    BitReader reader(bytes.data() + prefix, bytes.size() - prefix);
+    vector<SymbolInfo> codes;
+    if (!readCodeTable(reader, codes) || codes.size() != 256) return false;
+    for (const auto& info : codes) dictionary.lengths[info.symbol] = info.length;
+    return dictionaryId(dictionary.lengths) == dictionary.id;
+}
+
+namespace detail {
+
+// Order-1 model: a code per previous byte (the first byte of a block uses
+// context 0). Contexts too sparse to pay for their own table share one
+// order-0 fallback code built from the bytes they cover.
+//
+// Body: 256-bit map of contexts with their own table, those tables in
+// context order, a bit telling whether a fallback table follows, the
+// fallback table, then the payload.
+constexpr uint64_t MIN_CONTEXT_COUNT = 32;
+
+struct Order1Model {
+    array<vector<SymbolInfo>, 256> contexts;    // empty: context uses the fallback
+    vector<SymbolInfo> fallback;
+    uint64_t body_bits = 0;
+    uint64_t table_bits = 0;    // of body_bits
+
+    // Working storage, kept when a model is rebuilt for the next block.
+    // Blocks are at most 2^30 bytes, so 32-bit counts suffice.
+    unique_ptr<array<array<uint32_t, 256>, 256>> counts;
+    vector<CodeTable> tables;
+};
+
+// Rebuilds `model` for `block`
+void buildOrder1Model(span<const unsigned char> block, const vector<SymbolInfo>& order0, int max_length,
+    Order1Model& model) {
+    if (!model.counts) model.counts = make_unique<array<array<uint32_t, 256>, 256>>();
+    auto& counts = model.counts;
+    for (auto& row : *counts) row.fill(0);
+    unsigned char prev = 0;
+    for (unsigned char c : block) {
+        (*counts)[prev][c]++;
+        prev = c;
+    }
+
+    array<uint8_t, 256> order0_length{};
+    for (const auto& info : order0) order0_length[info.symbol] = info.length;
+
+    for (auto& codes : model.contexts) codes.clear();
+    model.fallback.clear();
+    model.body_bits = 256 + 1;
+    model.table_bits = model.body_bits;
+    Histogram fallback_hist{};
+    bool any_fallback = false;
+    for (int ctx = 0; ctx < 256; ++ctx) {
+        Histogram hist{};
+        uint64_t total = 0, fallback_bits = 0;
+        for (int c = 0; c < 256; ++c) {
+            hist[c] = (*counts)[ctx][c];
+            total += hist[c];
+            fallback_bits += hist[c] * order0_length[c];
+        }
+        if (total == 0) continue;
+
+        if (total >= MIN_CONTEXT_COUNT) {
+            auto& codes = model.contexts[ctx];
+            buildShannonCodes(hist, codes, true);
+            limitCodeLengths(codes, hist, max_length);
+            uint64_t own_table_bits = codeTableBits(codes);
+            uint64_t own_bits = own_table_bits + payloadBits(codes, hist);
+            if (own_bits < fallback_bits) {
+                model.body_bits += own_bits;
+                model.table_bits += own_table_bits;
+                continue;
+            }
+            codes.clear();
+        }
+        for (int c = 0; c < 256; ++c) fallback_hist[c] += hist[c];
+        any_fallback = true;
+    }
+    if (any_fallback) {
+        buildShannonCodes(fallback_hist, model.fallback, true);
+        limitCodeLengths(model.fallback, fallback_hist, max_length);
+        uint64_t fallback_table_bits = codeTableBits(model.fallback);
+        model.body_bits += fallback_table_bits + payloadBits(model.fallback, fallback_hist);
+        model.table_bits += fallback_table_bits;
+    }
+}
+
+void writeOrder1Body(BitWriter& writer, span<const unsigned char> block, Order1Model& model) {
+    for (int ctx = 0; ctx < 256; ++ctx) writer.write(model.contexts[ctx].empty() ? 0 : 1, 1);
+    for (int ctx = 0; ctx < 256; ++ctx) {
+        if (!model.contexts[ctx].empty()) writeCodeTable(writer, model.contexts[ctx]);
+    }
+    writer.write(model.fallback.empty() ? 0 : 1, 1);
+    if (!model.fallback.empty()) writeCodeTable(writer, model.fallback);
+
+    auto& tables = model.tables;
+    tables.resize(256);
+    CodeTable fallback = makeCodeTable(model.fallback);
+    for (int ctx = 0; ctx < 256; ++ctx) {
+        tables[ctx] = model.contexts[ctx].empty() ? fallback : makeCodeTable(model.contexts[ctx]);
+    }
+    unsigned char prev = 0;
+    for (unsigned char c : block) {
+        writer.write(tables[prev][c]);
+        prev = c;
+    }
+}
+
+void putBlockHeader(vector<unsigned char>& out, BlockMode mode, size_t raw_size, uint64_t body_bits) {
+    out.push_back(mode);
+    putVarint(out, raw_size);
+    putVarint(out, (body_bits + 7) / 8);
+}
+
+// rANS backend: four interleaved 32-bit states with 16-bit renormalization
+// over frequencies normalized to 2^RANS_SCALE_BITS, so the decoder's
+// slot -> symbol table is 4 KiB. Symbol i is coded by state i % 4; the
+// encoder runs backwards and the decoder forwards, and the independent
+// states let consecutive symbols decode in parallel.
+//
+// Body: frequency table (flag bit, then sparse list of symbol and freq - 1
+// or presence map and freq - 1 per present symbol), zero padding to a byte,
+// the four final encoder states (4 bytes little-endian each), then 16-bit
+// little-endian renormalization words in decoding order.
+constexpr int RANS_SCALE_BITS = 12;
+constexpr uint32_t RANS_SCALE = 1u << RANS_SCALE_BITS;
+constexpr uint32_t RANS_LOW = 1u << 16;
+constexpr int RANS_LANES = 4;
+
+using RansFrequencies = array<uint32_t, 256>;
+
+// Scales probabilities (as from calculateProbabilities) to integer
+// frequencies summing to RANS_SCALE, keeping every present symbol >= 1
+RansFrequencies normalizeFrequencies(const Probabilities& probabilities) {
+    RansFrequencies freq{};
+    int64_t sum = 0;
+    int largest = -1;
+    for (int c = 0; c < 256; ++c) {
+        if (probabilities[c] <= 0) continue;
+        freq[c] = max<uint32_t>(1, static_cast<uint32_t>(llround(probabilities[c] * RANS_SCALE)));
+        sum += freq[c];
+        if (largest < 0 || freq[c] > freq[largest]) largest = c;
+    }
+    if (largest < 0) return freq;
+
+    // Rounding error goes to the largest symbols, where it costs least
+    while (sum != RANS_SCALE) {
+        int pick = -1;
+        for (int c = 0; c < 256; ++c) {
+            if (!freq[c] || (sum > RANS_SCALE && freq[c] == 1)) continue;
+            if (pick < 0 || freq[c] > freq[pick]) pick = c;
+        }
+        int64_t step = sum > RANS_SCALE ? -min<int64_t>(sum - RANS_SCALE, freq[pick] - 1) : RANS_SCALE - sum;
+        freq[pick] = static_cast<uint32_t>(freq[pick] + step);
+        sum += step;
+    }
+    return freq;
+}
+
+void writeRansTable(BitWriter& writer, const RansFrequencies& freq) {
+    size_t count = 0;
+    for (uint32_t f : freq) count += f != 0;
+    bool dense = 1 + 256 + count * RANS_SCALE_BITS < 1 + 8 + count * (8 + RANS_SCALE_BITS);
+    writer.write(dense ? 1 : 0, 1);
+    if (!dense) writer.write(count - 1, 8);
+    for (int c = 0; c < 256; ++c) {
+        if (dense) writer.write(freq[c] ? 1 : 0, 1);
+    }
+    for (int c = 0; c < 256; ++c) {
+        if (!freq[c]) continue;
+        if (!dense) writer.write(c, 8);
+        writer.write(freq[c] - 1, RANS_SCALE_BITS);
+    }
+}
+
+bool readRansTable(BitReader& reader, RansFrequencies& freq) {
+    freq.fill(0);
+    uint64_t dense, value, sum = 0;
+    if (!reader.read(1, dense)) return false;
+    if (dense) {
+        uint64_t present[4] = {};
+        for (int c = 0; c < 256; ++c) {
+            if (!reader.read(1, value)) return false;
+            present[c / 64] |= value << (c % 64);
+        }
+        for (int c = 0; c < 256; ++c) {
+            if (!((present[c / 64] >> (c % 64)) & 1)) continue;
+            if (!reader.read(RANS_SCALE_BITS, value)) return false;
+            freq[c] = static_cast<uint32_t>(value + 1);
+        }
+    }
+    else {
+        uint64_t count, symbol;
+        if (!reader.read(8, count)) return false;
+        for (uint64_t i = 0; i <= count; ++i) {
+            if (!reader.read(8, symbol) || !reader.read(RANS_SCALE_BITS, value) || freq[symbol]) return false;
+            freq[symbol] = static_cast<uint32_t>(value + 1);
+        }
+    }
+    for (uint32_t f : freq) sum += f;
+    return sum == RANS_SCALE;
+}
+
+// Appends the rANS body for `block` to `out`
+// `words` is scratch space
+// Returns the size of the frequency table at the front of the body
+size_t writeRansBody(span<const unsigned char> block, const RansFrequencies& freq, vector<unsigned char>& out,
+    vector<uint16_t>& words) {
+    size_t start = out.size();
+    {
+        BitWriter writer(out);
+        writeRansTable(writer, freq);
+        writer.finish();
+    }
+    size_t table_size = out.size() - start;
+
+    array<uint32_t, 256> cum{};
+    for (int c = 1; c < 256; ++c) cum[c] = cum[c - 1] + freq[c - 1];
+
+    words.clear();
+    uint32_t state[RANS_LANES] = { RANS_LOW, RANS_LOW, RANS_LOW, RANS_LOW };
+    for (size_t i = block.size(); i-- > 0;) {
+        uint32_t& x = state[i % RANS_LANES];
+        unsigned char c = block[i];
+        uint32_t f = freq[c];
+        uint32_t x_max = ((RANS_LOW >> RANS_SCALE_BITS) << 16) * f;
+        if (x >= x_max) {
+            words.push_back(static_cast<uint16_t>(x));
+            x >>= 16;
+        }
+        x = ((x / f) << RANS_SCALE_BITS) + (x % f) + cum[c];
+    }
+
+    for (uint32_t x : state) {
+        for (int i = 0; i < 4; ++i) out.push_back(static_cast<unsigned char>(x >> (8 * i)));
+    }
+    for (size_t i = words.size(); i-- > 0;) {
+        out.push_back(static_cast<unsigned char>(words[i]));
+        out.push_back(static_cast<unsigned char>(words[i] >> 8));
+    }
+    return table_size;
+}
+
+// Decoding must consume every word and bring all states back to RANS_LOW,
+// which catches most corruption for free
+struct RansSlot {
+    uint16_t freq;
+    uint16_t start;     // slot - cum, added after the multiply
+    unsigned char symbol;
+};
+
+// Tables and buffers for decoding one block, reused like EncodeScratch
+struct DecodeScratch {
+    vector<SymbolInfo> codes;
+    vector<DecodeTable> tables;     // one per order-1 context, then fallback and empty
+    vector<RansSlot> rans_slots;
+    vector<unsigned char> decoded;  // for decoders that cannot write in place
+    vector<unsigned char> transformed;  // inner block of a transformed block
+    vector<unsigned char> column;
+    vector<uint32_t> bwt_next;
+
+    // Counters for the current block, kept only when `collect` is set
+    bool collect = false;
+    CodingStats stats;
+    Clock::time_point mark;
+    const DecodeTable* lookups = nullptr;   // table that decoded the payload
+
+    // Ends the table stage of the block
+    void tableRead(uint64_t bits, const DecodeTable* table = nullptr) {
+        if (!collect) return;
+        stats.table_seconds = lap(mark);
+        stats.table_bits = bits;
+        lookups = table;
+    }
+};
+
+bool decodeRansBody(span<const unsigned char> body, unsigned char* out, size_t raw_size, DecodeScratch& scratch) {
+    BitReader reader(body.data(), body.size());
+    RansFrequencies freq;
+    if (!readRansTable(reader, freq)) return false;
+    size_t pos = static_cast<size_t>((uint64_t(body.size()) * 8 - reader.remaining() + 7) / 8);
+    if (body.size() - pos < 4 * RANS_LANES) return false;
+
+    auto& slots = scratch.rans_slots;
+    slots.resize(RANS_SCALE);
+    uint32_t cum = 0;
+    for (int c = 0; c < 256; ++c) {
+        for (uint32_t i = 0; i < freq[c]; ++i) {
+            slots[cum + i] = { static_cast<uint16_t>(freq[c]), static_cast<uint16_t>(i), static_cast<unsigned char>(c) };
+        }
+        cum += freq[c];
+    }
+    scratch.tableRead(uint64_t(pos) * 8);
+
+    uint32_t state[RANS_LANES];
+    for (int lane = 0; lane < RANS_LANES; ++lane) {
+        state[lane] = 0;
+        for (int i = 0; i < 4; ++i) state[lane] |= static_cast<uint32_t>(body[pos++]) << (8 * i);
+        if (state[lane] < RANS_LOW) return false;
+    }
+
+    const unsigned char* words = body.data() + pos;
+    const unsigned char* words_end = body.data() + body.size();
+    auto step = [&](uint32_t& x, unsigned char& symbol) {
+        const RansSlot& slot = slots[x & (RANS_SCALE - 1)];
+        symbol = slot.symbol;
+        x = slot.freq * (x >> RANS_SCALE_BITS) + slot.start;
+        if (x < RANS_LOW) {
+            if (words_end - words < 2) return false;
+            x = (x << 16) | words[0] | (static_cast<uint32_t>(words[1]) << 8);
+            words += 2;
+        }
+        return true;
+    };
+
+    size_t i = 0;
+    for (; i + RANS_LANES <= raw_size; i += RANS_LANES) {
+        bool ok = step(state[0], out[i]);
+        ok &= step(state[1], out[i + 1]);
+        ok &= step(state[2], out[i + 2]);
+        ok &= step(state[3], out[i + 3]);
+        if (!ok) return false;
+    }
+    for (; i < raw_size; ++i) {
+        if (!step(state[i % RANS_LANES], out[i])) return false;
+    }
+
+    for (uint32_t x : state) {
+        if (x != RANS_LOW) return false;
+    }
+    return words == words_end;
+}
+
+// RLE: after RLE_MIN_RUN equal bytes comes a byte counting how many more
+// follow, so a run of any length costs five bytes per 259
+constexpr size_t RLE_MIN_RUN = 4;
+constexpr size_t RLE_MAX_RUN = RLE_MIN_RUN + 255;
+
+void runLengthEncode(span<const unsigned char> data, vector<unsigned char>& out) {
+    out.clear();
+    for (size_t i = 0; i < data.size();) {
+        unsigned char c = data[i];
+        size_t run = 1;
+        while (i + run < data.size() && data[i + run] == c && run < RLE_MAX_RUN) ++run;
+        out.insert(out.end(), min(run, RLE_MIN_RUN), c);
+        if (run >= RLE_MIN_RUN) out.push_back(static_cast<unsigned char>(run - RLE_MIN_RUN));
+        i += run;
+    }
+}
+
+// Longest RLE output for `raw_size` bytes: four literals then a count byte
+uint64_t runLengthBound(uint64_t raw_size) {
+    return raw_size + raw_size / RLE_MIN_RUN + 1;
+}
+
+// Fails unless `data` expands to exactly `raw_size` bytes
+bool runLengthDecode(span<const unsigned char> data, unsigned char* out, size_t raw_size) {
+    size_t produced = 0;
+    size_t same = 0;
+    for (size_t i = 0; i < data.size(); ++i) {
+        unsigned char c = data[i];
+        if (same == RLE_MIN_RUN) {
+            if (raw_size - produced < c) return false;
+            memset(out + produced, out[produced - 1], c);
+            produced += c;
+            same = 0;
+            continue;
+        }
+        if (produced == raw_size) return false;
+        same = same && out[produced - 1] == c ? same + 1 : 1;
+        out[produced++] = c;
+    }
+    return same != RLE_MIN_RUN && produced == raw_size;
+}
+
+// Replaces every byte by its position in a list of recently seen bytes,
+// which turns the clusters a BWT leaves into small numbers, mostly zeros
+void moveToFrontEncode(span<unsigned char> data) {
+    array<unsigned char, 256> order;
+    for (int i = 0; i < 256; ++i) order[i] = static_cast<unsigned char>(i);
+    for (auto& c : data) {
+        unsigned char symbol = c;
+        unsigned char index = 0;
+        while (order[index] != symbol) ++index;
+        memmove(order.data() + 1, order.data(), index);
+        order[0] = symbol;
+        c = index;
+    }
+}
+
+void moveToFrontDecode(span<unsigned char> data) {
+    array<unsigned char, 256> order;
+    for (int i = 0; i < 256; ++i) order[i] = static_cast<unsigned char>(i);
+    for (auto& c : data) {
+        unsigned char index = c;
+        unsigned char symbol = order[index];
+        memmove(order.data() + 1, order.data(), index);
+        order[0] = symbol;
+        c = symbol;
+    }
+}
+
+struct BwtBuffers {
+    vector<uint32_t> order;         // rotations sorted so far
+    vector<uint32_t> classes;       // equal prefixes share a class
+    vector<uint32_t> shifted;
+    vector<uint32_t> next_classes;
+    vector<uint32_t> counts;
+};
+
+// Burrows-Wheeler transform of `block` with an implicit end marker below
+// every byte, which makes all rotations distinct. Rotations are sorted by
+// prefix doubling: each pass orders them by twice as many characters with
+// one counting sort over the previous classes, and the passes stop once
+// every class is a single rotation. `out` gets the last column without the
+// marker; returns the row that held it.
+size_t bwtEncode(span<const unsigned char> block, vector<unsigned char>& out, BwtBuffers& buffers) {
+    size_t n = block.size();
+    size_t m = n + 1;
+    auto& order = buffers.order;
+    auto& classes = buffers.classes;
+    auto& shifted = buffers.shifted;
+    auto& next_classes = buffers.next_classes;
+    auto& counts = buffers.counts;
+    order.resize(m);
+    classes.resize(m);
+    shifted.resize(m);
+    next_classes.resize(m);
+    auto symbol = [&](size_t i) { return i < n ? block[i] + 1u : 0u; };
+
+    counts.assign(257, 0);
+    for (size_t i = 0; i < m; ++i) counts[symbol(i)]++;
+    for (size_t c = 1; c < 257; ++c) counts[c] += counts[c - 1];
+    for (size_t i = m; i-- > 0;) order[--counts[symbol(i)]] = static_cast<uint32_t>(i);
+    uint32_t class_count = 1;
+    classes[order[0]] = 0;
+    for (size_t i = 1; i < m; ++i) {
+        if (symbol(order[i]) != symbol(order[i - 1])) class_count++;
+        classes[order[i]] = class_count - 1;
+    }
+
+    for (size_t length = 1; length < m && class_count < m; length <<= 1) {
+        // Ordered by their second half already; a stable sort by the first
+        // half finishes the pass
+        for (size_t i = 0; i < m; ++i) {
+            shifted[i] = static_cast<uint32_t>(order[i] >= length ? order[i] - length : order[i] + m - length);
+        }
+        counts.assign(class_count, 0);
+        for (size_t i = 0; i < m; ++i) counts[classes[shifted[i]]]++;
+        for (size_t c = 1; c < class_count; ++c) counts[c] += counts[c - 1];
+        for (size_t i = m; i-- > 0;) order[--counts[classes[shifted[i]]]] = shifted[i];
+
+        auto second = [&](uint32_t i) { return classes[i + length < m ? i + length : i + length - m]; };
+        class_count = 1;
+        next_classes[order[0]] = 0;
+        for (size_t i = 1; i < m; ++i) {
+            if (classes[order[i]] != classes[order[i - 1]] || second(order[i]) != second(order[i - 1])) class_count++;
+            next_classes[order[i]] = class_count - 1;
+        }
+        classes.swap(next_classes);
+    }
+
+    out.resize(n);
+    size_t primary = 0;
+    for (size_t i = 0, j = 0; i < m; ++i) {
+        if (order[i] == 0) primary = i;
+        else out[j++] = block[order[i] - 1];
+    }
+    return primary;
+}
+
+// Inverts bwtEncode into `raw_size` = column.size() bytes. Walking from the
+// marker's rotation back through the last column yields the block from its
+// end; a corrupted column shows up as reaching the marker early or late.
+bool bwtDecode(span<const unsigned char> column, uint64_t primary, unsigned char* out, vector<uint32_t>& next) {
+    size_t n = column.size();
+    size_t m = n + 1;
+    if (primary == 0 || primary >= m) return false;
+    auto last = [&](size_t row) { return column[row < primary ? row : row - 1]; };
+
+    array<uint32_t, 256> first{};
+    for (unsigned char c : column) first[c]++;
+    uint32_t sum = 1;
+    for (auto& count : first) {
+        uint32_t here = count;
+        count = sum;
+        sum += here;
+    }
+    next.resize(m);
+    for (size_t row = 0; row < m; ++row) {
+        if (row != primary) next[row] = first[last(row)]++;
+    }
+
+    size_t row = 0;
+    for (size_t k = n; k-- > 0;) {
+        if (row == primary) return false;
+        out[k] = last(row);
+        row = next[row];
+    }
+    return row == primary;
+}
+
+// Appends one complete block (header and body) for `block` to `out`. Every
+// candidate's exact size is known from the histogram alone, so the encoder
+// picks the smallest of the Shannon code, a length-limited Huffman code, the
+// order-1 model (when enabled) and a raw copy before writing any bits. The
+// header goes first and the bits are written in place behind it.
+//
+// Everything but the output lives in `scratch`, which a context hands from
+// block to block, so a warmed-up encoder does not allocate.
+struct EncodeScratch {
+    vector<unsigned char> encoded;
+    vector<SymbolInfo> shannon;
+    vector<SymbolInfo> huffman;
+    vector<SymbolInfo> shared;
+    vector<vector<HuffmanCoin>> levels;
+    Order1Model order1;
+    vector<unsigned char> body;     // rANS and interleaved bodies, sized before their header
+    vector<uint16_t> rans_words;
+    vector<unsigned char> streams;
+    vector<unsigned char> column;       // BWT output
+    vector<unsigned char> runs;         // RLE output
+    vector<unsigned char> transformed;  // transformed block body
+    vector<unsigned char> plain;        // the same block untransformed, when in doubt
+    BwtBuffers bwt;
+    CodingStats stats;      // of the last block
+    uint32_t checksum = 0;  // of the last raw block, with checksums enabled
+    unique_ptr<DecodeScratch> verify;   // for EncodeOptions::verify
+    bool verified = true;   // the last block decoded back to its input
+};
+
+bool isRun(span<const unsigned char> block) {
+    return !block.empty() && memcmp(block.data(), block.data() + 1, block.size() - 1) == 0;
+}
+
+// Size of each of the STREAM_COUNT parts of a block; the last may be shorter
+size_t streamLength(size_t raw_size) {
+    return (raw_size + STREAM_COUNT - 1) / STREAM_COUNT;
+}
+
+// Writes the table and streams of an interleaved block; returns the table bits
+uint64_t writeInterleavedBody(span<const unsigned char> block, const vector<SymbolInfo>& codes,
+    vector<unsigned char>& out, vector<unsigned char>& streams) {
+    {
+        BitWriter writer(out);
+        writeCodeTable(writer, codes);
+        writer.finish();
+    }
+    uint64_t table_bits = uint64_t(out.size()) * 8;
+
+    CodeTable code_table = makeCodeTable(codes);
+    int longest = longestCode(codes);
+    size_t length = streamLength(block.size());
+    streams.clear();
+    for (int i = 0; i < STREAM_COUNT; ++i) {
+        auto part = block.subspan(min(block.size(), i * length));
+        part = part.first(min(length, part.size()));
+        size_t start = streams.size();
+        BitWriter writer(streams);
+        writer.writeSymbols(part, code_table, longest);
+        writer.finish();
+        if (i + 1 < STREAM_COUNT) putVarint(out, streams.size() - start);
+    }
+    out.insert(out.end(), streams.begin(), streams.end());
+    return table_bits;
+}
+
+void encodeBlock(span<const unsigned char> block, vector<unsigned char>& out, const EncodeOptions& options,
+    EncodeScratch& scratch) {
+    CodingStats& stats = scratch.stats;
+    stats = {};
+    stats.raw_bytes = block.size();
+    Clock::time_point mark = Clock::now();
+    if (isRun(block)) {
+        putBlockHeader(out, BLOCK_RUN, block.size(), 8);
+        out.push_back(block[0]);
+        stats.code_seconds = lap(mark);
+        stats.symbols = block.size();
+        stats.payload_bits = 8;
+        return;
+    }
+
+    // The transformed bytes are coded as an inner block. No order-0 code of
+    // the raw block gets below its entropy, so only a transformed block
+    // above that (or any with order-1 allowed) is checked against coding the
+    // block as it is.
+    if (options.transforms) {
+        span<const unsigned char> data = block;
+        uint8_t applied = 0;
+        size_t primary = 0;
+        if (options.transforms & TRANSFORM_BWT) {
+            primary = bwtEncode(block, scratch.column, scratch.bwt);
+            moveToFrontEncode(scratch.column);
+            data = scratch.column;
+            applied |= TRANSFORM_BWT;
+        }
+        if (options.transforms & TRANSFORM_RLE) {
+            runLengthEncode(data, scratch.runs);
+            if (scratch.runs.size() < data.size()) {
+                data = scratch.runs;
+                applied |= TRANSFORM_RLE;
+            }
+        }
+        double transform_seconds = lap(mark);
+        if (applied) {
+            auto& body = scratch.transformed;
+            body.assign(1, applied);
+            if (applied & TRANSFORM_BWT) putVarint(body, primary);
+            EncodeOptions inner = options;
+            inner.transforms = 0;
+            encodeBlock(data, body, inner, scratch);
+            CodingStats transformed_stats = stats;
+            transformed_stats.raw_bytes = block.size();
+            transformed_stats.transform_seconds = transform_seconds;
+
+            auto& plain = scratch.plain;
+            plain.clear();
+            if (options.order1 || uint64_t(body.size()) * 8 >= entropyBits(buildHistogram(block))) {
+                encodeBlock(block, plain, inner, scratch);
+            }
+            size_t start = out.size();
+            putBlockHeader(out, BLOCK_TRANSFORMED, block.size(), uint64_t(body.size()) * 8);
+            if (plain.empty() || out.size() - start + body.size() < plain.size()) {
+                out.insert(out.end(), body.begin(), body.end());
+                stats = transformed_stats;
+            }
+            else {
+                out.resize(start);
+                out.insert(out.end(), plain.begin(), plain.end());
+                stats.transform_seconds = transform_seconds;
+            }
+            return;
+        }
+        stats = {};
+        stats.raw_bytes = block.size();
+        stats.transform_seconds = transform_seconds;
+        mark = Clock::now();
+    }
+
+    Histogram hist = buildHistogram(block);
+    stats.histogram_seconds = lap(mark);
+    auto coded = [&](uint64_t payload_bits, uint64_t table_bits) {
+        stats.code_seconds = lap(mark);
+        stats.symbols = block.size();
+        stats.payload_bits = payload_bits;
+        stats.table_bits = table_bits;
+        stats.entropy_bits = entropyBits(hist);
+    };
+    auto store = [&] {
+        putBlockHeader(out, BLOCK_STORED, block.size(), uint64_t(block.size()) * 8);
+        out.insert(out.end(), block.begin(), block.end());
+        stats.code_seconds = lap(mark);
+        stats.stored_bytes = block.size();
+    };
+
+    if (options.backend == BACKEND_RANS) {
+        auto& body = scratch.body;
+        body.clear();
+        RansFrequencies freq = normalizeFrequencies(probabilitiesFromHistogram(hist));
+        stats.table_seconds = lap(mark);
+        size_t table_size = writeRansBody(block, freq, body, scratch.rans_words);
+        if (body.size() < block.size()) {
+            putBlockHeader(out, BLOCK_RANS, block.size(), uint64_t(body.size()) * 8);
+            out.insert(out.end(), body.begin(), body.end());
+            coded(uint64_t(body.size() - table_size) * 8, uint64_t(table_size) * 8);
+        }
+        else {
+            store();
+        }
+        return;
+    }
+
+    uint64_t stored_bits = uint64_t(block.size()) * 8;
+    if (block.size() < TINY_BLOCK_SIZE && !options.dictionary) {
+        size_t distinct = static_cast<size_t>(count_if(hist.begin(), hist.end(), [](uint64_t count) { return count != 0; }));
+        if (min(sparseTableBits(distinct), denseTableBits(distinct)) + block.size() >= stored_bits) {
+            store();
+            return;
+        }
+    }
+
+    auto& shannon = scratch.shannon;
+    auto& huffman = scratch.huffman;
+    buildShannonCodes(hist, shannon, true);
+    limitCodeLengths(shannon, hist, options.max_code_length);
+    buildHuffmanCodes(hist, options.max_code_length, huffman, scratch.levels);
+
+    uint64_t shannon_bits = codeTableBits(shannon) + payloadBits(shannon, hist);
+    uint64_t huffman_bits = codeTableBits(huffman) + payloadBits(huffman, hist);
+
+    const vector<SymbolInfo>* codes = &shannon;
+    BlockMode mode = BLOCK_SHANNON;
+    uint64_t best_bits = shannon_bits;
+    if (huffman_bits < best_bits) {
+        codes = &huffman;
+        mode = BLOCK_HUFFMAN;
+        best_bits = huffman_bits;
+    }
+    auto& shared = scratch.shared;
+    if (options.dictionary) {
+        dictionaryCodes(*options.dictionary, shared);
+        uint64_t shared_bits = payloadBits(shared, hist);
+        if (shared_bits < best_bits) {
+            codes = &shared;
+            mode = BLOCK_DICTIONARY;
+            best_bits = shared_bits;
+        }
+    }
+    if (options.order1) {
+        Order1Model& model = scratch.order1;
+        buildOrder1Model(block, *codes, options.max_code_length, model);
+        if (model.body_bits < best_bits && model.body_bits < stored_bits) {
+            stats.table_seconds = lap(mark);
+            putBlockHeader(out, BLOCK_ORDER1, block.size(), model.body_bits);
+            BitWriter writer(out);
+            writeOrder1Body(writer, block, model);
+            writer.finish();
+            coded(model.body_bits - model.table_bits, model.table_bits);
+            return;
+        }
+    }
+    stats.table_seconds = lap(mark);
+    if (stored_bits <= best_bits) {
+        store();
+        return;
+    }
+
+    if (options.interleaved && mode != BLOCK_DICTIONARY && codes->size() > 1 && block.size() >= MIN_INTERLEAVED_SIZE) {
+        auto& body = scratch.body;
+        body.clear();
+        uint64_t table_bits = writeInterleavedBody(block, *codes, body, scratch.streams);
+        putBlockHeader(out, BLOCK_INTERLEAVED, block.size(), uint64_t(body.size()) * 8);
+        out.insert(out.end(), body.begin(), body.end());
+        coded(uint64_t(body.size()) * 8 - table_bits, table_bits);
+        return;
+    }
+
+    putBlockHeader(out, mode, block.size(), best_bits);
+    CodeTable code_table = makeCodeTable(*codes);
+    BitWriter writer(out);
+    if (mode != BLOCK_DICTIONARY) writeCodeTable(writer, *codes);
+    writer.writeSymbols(block, code_table, longestCode(*codes));
+    writer.finish();
+    uint64_t table_bits = mode != BLOCK_DICTIONARY ? codeTableBits(*codes) : 0;
+    coded(best_bits - table_bits, table_bits);
+}
+
+// Shannon and Huffman blocks differ only in how the encoder chose the lengths
+bool decodePrefixBody(BitReader& reader, unsigned char* out, size_t raw_size, DecodeScratch& scratch) {
+    uint64_t body_bits = reader.remaining();
+    auto& codes = scratch.codes;
+    if (!readCodeTable(reader, codes)) return false;
+
+    uint64_t table_bits = body_bits - reader.remaining();
+
+    // A block of one repeated byte has a single zero-length code
+    if (codes.size() == 1 && codes[0].length == 0) {
+        scratch.tableRead(table_bits);
+        memset(out, codes[0].symbol, raw_size);
+        return true;
+    }
+
+    scratch.tables.resize(max<size_t>(scratch.tables.size(), 1));
+    DecodeTable& table = scratch.tables[0];
+    if (!table.build(codes)) return false;
+    scratch.tableRead(table_bits, &table);
+    return table.decode(reader, out, raw_size) == raw_size;
+}
+
+// One table serves every stream
+bool decodeInterleavedBody(span<const unsigned char> body, unsigned char* out, size_t raw_size, DecodeScratch& scratch) {
+    BitReader reader(body.data(), body.size());
+    auto& codes = scratch.codes;
+    if (!readCodeTable(reader, codes)) return false;
+    size_t pos = static_cast<size_t>((uint64_t(body.size()) * 8 - reader.remaining() + 7) / 8);
+
+    size_t sizes[STREAM_COUNT];
+    size_t total = 0;
+    for (int i = 0; i + 1 < STREAM_COUNT; ++i) {
+        uint64_t size;
+        if (!getVarint(body, pos, size) || size > body.size()) return false;
+        sizes[i] = static_cast<size_t>(size);
+        total += sizes[i];
+    }
+    if (total > body.size() - pos) return false;
+    sizes[STREAM_COUNT - 1] = body.size() - pos - total;
+
+    scratch.tables.resize(max<size_t>(scratch.tables.size(), 1));
+    DecodeTable& table = scratch.tables[0];
+    if (!table.build(codes)) return false;
+    scratch.tableRead(uint64_t(pos) * 8, &table);
+
+    static_assert(STREAM_COUNT == 4);
+    const unsigned char* data = body.data() + pos;
+    BitReader readers[STREAM_COUNT] = {
+        BitReader(data, sizes[0]),
+        BitReader(data + sizes[0], sizes[1]),
+        BitReader(data + sizes[0] + sizes[1], sizes[2]),
+        BitReader(data + sizes[0] + sizes[1] + sizes[2], sizes[3]),
+    };
+    size_t length = streamLength(raw_size);
+    unsigned char* outputs[STREAM_COUNT];
+    size_t counts[STREAM_COUNT];
+    for (int i = 0; i < STREAM_COUNT; ++i) {
+        size_t start = min(raw_size, i * length);
+        outputs[i] = out + start;
+        counts[i] = min(length, raw_size - start);
+    }
+
+    // Parts only get shorter, so the last one is common to all
+    size_t common = counts[STREAM_COUNT - 1];
+    if (!table.decodeInterleaved(readers, outputs, common)) return false;
+    for (int i = 0; i < STREAM_COUNT; ++i) {
+        size_t rest = counts[i] - common;
+        if (table.decode(readers[i], outputs[i] + common, rest) != rest) return false;
+    }
+    return true;
+}
+
+// Every context resolves to a table up front, so the loop switches tables
+// with one indexed load. Contexts without any code point at an empty table
+// that rejects all input.
+bool decodeOrder1Body(BitReader& reader, unsigned char* out, size_t raw_size, DecodeScratch& scratch) {
+    uint64_t body_bits = reader.remaining();
+    uint64_t own[4] = {};
+    for (int ctx = 0; ctx < 256; ++ctx) {
+        uint64_t bit;
+        if (!reader.read(1, bit)) return false;
+        own[ctx / 64] |= bit << (ctx % 64);
+    }
+
+    auto& tables = scratch.tables;
+    tables.resize(258);
+    DecodeTable& fallback = tables[256];
+    DecodeTable& empty = tables[257];
+    auto& codes = scratch.codes;
+    codes.clear();
+    empty.build(codes);
+    for (int ctx = 0; ctx < 256; ++ctx) {
+        if (!((own[ctx / 64] >> (ctx % 64)) & 1)) continue;
+        if (!readCodeTable(reader, codes) || !tables[ctx].build(codes)) return false;
+    }
+    uint64_t has_fallback;
+    if (!reader.read(1, has_fallback)) return false;
+    if (has_fallback && (!readCodeTable(reader, codes) || !fallback.build(codes))) return false;
+    scratch.tableRead(body_bits - reader.remaining());
+
+    const DecodeTable* select[256];
+    for (int ctx = 0; ctx < 256; ++ctx) {
+        bool has_own = (own[ctx / 64] >> (ctx % 64)) & 1;
+        select[ctx] = has_own ? &tables[ctx] : has_fallback ? &fallback : &empty;
+    }
+
+    unsigned char prev = 0;
+    for (size_t i = 0; i < raw_size; ++i) {
+        if (!select[prev]->decodeSymbol(reader, out[i])) return false;
+        prev = out[i];
+    }
+    return true;
+}
+
+// Decodes a block body into exactly `raw_size` bytes at `out`
+bool decodeBody(uint8_t mode, span<const unsigned char> body, unsigned char* out, size_t raw_size,
+    DecodeScratch& scratch, const DecodeTable* dictionary) {
+    if (mode == BLOCK_STORED) {
+        if (body.size() != raw_size) return false;
+        if (raw_size) memcpy(out, body.data(), raw_size);
+        return true;
+    }
+    if (mode == BLOCK_RUN) {
+        if (body.size() != 1) return false;
+        memset(out, body[0], raw_size);
+        return true;
+    }
+    if (mode == BLOCK_TRANSFORMED) {
+        size_t pos = 1;
+        uint64_t primary = 0;
+        if (body.empty() || !body[0] || (body[0] & ~(TRANSFORM_RLE | TRANSFORM_BWT))) return false;
+        uint8_t applied = body[0];
+        if ((applied & TRANSFORM_BWT) && !getVarint(body, pos, primary)) return false;
+
+        uint64_t inner_size, inner_body;
+        if (pos >= body.size()) return false;
+        uint8_t inner_mode = body[pos++];
+        if (inner_mode == BLOCK_END || inner_mode == BLOCK_TRANSFORMED || !getVarint(body, pos, inner_size)
+            || !getVarint(body, pos, inner_body) || inner_body != body.size() - pos) {
+            return false;
+        }
+        if ((applied & TRANSFORM_RLE) ? inner_size > runLengthBound(raw_size) : inner_size != raw_size) return false;
+        auto& inner = scratch.transformed;
+        inner.resize(static_cast<size_t>(inner_size));
+        if (!decodeBody(inner_mode, body.subspan(pos), inner.data(), inner.size(), scratch, dictionary)) return false;
+        // Lookups were made on the transformed bytes, so they cannot be
+        // matched to the block's histogram
+        scratch.lookups = nullptr;
+        if (scratch.collect) scratch.stats.code_seconds += lap(scratch.mark);
+
+        bool ok;
+        if (applied & TRANSFORM_BWT) {
+            auto& column = scratch.column;
+            if (applied & TRANSFORM_RLE) {
+                column.resize(raw_size);
+                if (!runLengthDecode(inner, column.data(), raw_size)) return false;
+            }
+            else {
+                column.swap(inner);
+            }
+            moveToFrontDecode(column);
+            ok = bwtDecode(column, primary, out, scratch.bwt_next);
+        }
+        else {
+            ok = runLengthDecode(inner, out, raw_size);
+        }
+        if (scratch.collect) scratch.stats.transform_seconds += lap(scratch.mark);
+        return ok;
+    }
+    if (mode == BLOCK_RANS) return decodeRansBody(body, out, raw_size, scratch);
+    if (mode == BLOCK_INTERLEAVED) return decodeInterleavedBody(body, out, raw_size, scratch);
+
+    BitReader reader(body.data(), body.size());
+    switch (mode) {
+    case BLOCK_SHANNON:
+    case BLOCK_HUFFMAN:
+        return decodePrefixBody(reader, out, raw_size, scratch);
+    case BLOCK_ORDER1:
+        return decodeOrder1Body(reader, out, raw_size, scratch);
+    case BLOCK_DICTIONARY:
+        scratch.tableRead(0, dictionary);
+        return dictionary && dictionary->decode(reader, out, raw_size) == raw_size;
+    default:
+        return false;
+    }
+}
+
+// As decodeBody; with `scratch.collect` set, `scratch.stats` describes the
+// block afterwards
+bool decodeBlock(uint8_t mode, span<const unsigned char> body, unsigned char* out, size_t raw_size,
+    DecodeScratch& scratch, const DecodeTable* dictionary = nullptr) {
+    if (!scratch.collect) return decodeBody(mode, body, out, raw_size, scratch, dictionary);
+
+    CodingStats& stats = scratch.stats;
+    stats = {};
+    scratch.lookups = nullptr;
+    scratch.mark = Clock::now();
+    if (!decodeBody(mode, body, out, raw_size, scratch, dictionary)) return false;
+    stats.code_seconds += lap(scratch.mark);
+    stats.raw_bytes = raw_size;
+    if (mode == BLOCK_STORED) {
+        stats.stored_bytes = raw_size;
+        return true;
+    }
+    Histogram hist = buildHistogram(span<const unsigned char>(out, raw_size));
+    stats.symbols = raw_size;
+    stats.payload_bits = uint64_t(body.size()) * 8 - stats.table_bits;
+    stats.entropy_bits = entropyBits(hist);
+    if (scratch.lookups) {
+        stats.table_lookups = raw_size;
+        stats.table_misses = scratch.lookups->misses(hist);
+    }
+    return true;
+}
+
+// Decodes a block just produced by encodeBlock the way a reader of the
+// container would, and compares it with the input
+bool verifyBlock(span<const unsigned char> block, span<const unsigned char> encoded, DecodeScratch& scratch,
+    const DecodeTable* dictionary) {
+    size_t pos = 1;
+    uint64_t raw_size, body_size;
+    if (encoded.empty() || !getVarint(encoded, pos, raw_size) || !getVarint(encoded, pos, body_size)) return false;
+    if (raw_size != block.size() || body_size != encoded.size() - pos) return false;
+    auto& decoded = scratch.decoded;
+    decoded.resize(block.size());
+    if (!decodeBlock(encoded[0], encoded.subspan(pos), decoded.data(), decoded.size(), scratch, dictionary)) return false;
+    return equal(block.begin(), block.end(), decoded.begin());
+}
+
+// Fixed set of worker threads pulling jobs from a shared queue. A pool
+// with no workers runs every job inline on the submitting thread.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads) {
+        if (threads <= 1) return;
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([this] { run(); });
+        }
+        started += threads;
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(guard);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    unsigned size() const { return workers.empty() ? 1 : static_cast<unsigned>(workers.size()); }
+
+    // Workers started by all pools so far, for tests that check a path
+    // stays on the calling thread
+    static uint64_t workersStarted() { return started; }
+
+    // `here` runs the job on the calling thread, for a lone job that would
+    // only pay for the hand-off
+    template <class F>
+    future<invoke_result_t<F>> submit(F&& job, bool here = false) {
+        auto task = make_shared<packaged_task<invoke_result_t<F>()>>(std::forward<F>(job));
+        auto result = task->get_future();
+        if (here || workers.empty()) {
+            (*task)();
+            return result;
+        }
+        {
+            lock_guard<mutex> lock(guard);
+            jobs.emplace_back([task] { (*task)(); });
+        }
+        wake.notify_one();
+        return result;
+    }
+
+private:
+    static inline atomic<uint64_t> started{ 0 };
+    vector<thread> workers;
+    deque<function<void()>> jobs;
+    mutex guard;
+    condition_variable wake;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            function<void()> job;
+            {
+                unique_lock<mutex> lock(guard);
+                wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+// Free list of per-block working buffers. A job takes one for the block it
+// codes and gives it back when the block is done, so at most one set per
+// block in flight ever exists and the buffers keep their capacity.
+template <class T>
+class ScratchPool {
+public:
+    unique_ptr<T> acquire() {
+        lock_guard<mutex> lock(guard);
+        if (items.empty()) return make_unique<T>();
+        unique_ptr<T> item = std::move(items.back());
+        items.pop_back();
+        return item;
+    }
+
+    void release(unique_ptr<T> item) {
+        lock_guard<mutex> lock(guard);
+        items.push_back(std::move(item));
+    }
+
+private:
+    mutex guard;
+    vector<unique_ptr<T>> items;
+};
+
+struct IndexEntry {
+    uint64_t stored_size;   // block header plus body
+    uint64_t raw_size;
+};
+
+// Receives finished container bytes; returns false on a write error
+using ByteSink = function<bool(span<const unsigned char>)>;
+
+// Pipelined file I/O. Reads and writes run on threads of their own with a
+// few blocks queued, so the device works on block N + 1 or N - 1 while
+// block N is coded. Plain threads keep this portable; io_uring or
+// overlapped I/O would only replace the loops in run().
+
+// Writes queued buffers to a stream; write() blocks only when `depth`
+// buffers are already waiting
+class WriteBehind {
+public:
+    explicit WriteBehind(ostream& output, size_t queue_depth = 4) : out(output), depth(queue_depth), worker([this] { run(); }) {}
+    WriteBehind(const WriteBehind&) = delete;
+    WriteBehind& operator=(const WriteBehind&) = delete;
+    ~WriteBehind() { close(); }
+
+    bool write(span<const unsigned char> bytes) {
+        unique_lock<mutex> lock(guard);
+        space.wait(lock, [this] { return queue.size() < depth; });
+        if (failed) return false;
+        vector<unsigned char> buffer;
+        if (!spare.empty()) {
+            buffer = std::move(spare.back());
+            spare.pop_back();
+        }
+        buffer.assign(bytes.begin(), bytes.end());
+        queue.push_back(std::move(buffer));
+        ready.notify_one();
+        return true;
+    }
+
+    // Waits for everything queued; false if any write failed
+    bool close() {
+        {
+            lock_guard<mutex> lock(guard);
+            closing = true;
+        }
+        ready.notify_one();
+        if (worker.joinable()) worker.join();
+        out.flush();
+        return !failed && static_cast<bool>(out);
+    }
+
+private:
+    ostream& out;
+    size_t depth;
+    mutex guard;
+    condition_variable ready;
+    condition_variable space;
+    deque<vector<unsigned char>> queue;
+    vector<vector<unsigned char>> spare;
+    bool closing = false;
+    bool failed = false;
+    thread worker;  // last, so it starts after the members it uses
+
+    void run() {
+        unique_lock<mutex> lock(guard);
+        while (true) {
+            ready.wait(lock, [this] { return !queue.empty() || closing; });
+            if (queue.empty()) return;
+            vector<unsigned char> buffer = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+            bool ok = static_cast<bool>(out);
+            lock.lock();
+            failed = failed || !ok;
+            spare.push_back(std::move(buffer));
+            space.notify_one();
+        }
+    }
+};
+
+// Reads consecutive blocks of a stream, at most `depth` ahead of next()
+class ReadAhead {
+public:
+    ReadAhead(istream& input, size_t read_size, size_t queue_depth = 2)
+        : in(input), block_size(read_size), depth(queue_depth), worker([this] { run(); }) {}
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+
+    ~ReadAhead() {
+        {
+            lock_guard<mutex> lock(guard);
+            stopping = true;
+        }
+        space.notify_one();
+        worker.join();
+    }
+
+    // The next block, or nullptr at the end of input
+    shared_ptr<vector<unsigned char>> next() {
+        unique_lock<mutex> lock(guard);
+        ready.wait(lock, [this] { return !queue.empty() || done; });
+        if (queue.empty()) return nullptr;
+        auto block = std::move(queue.front());
+        queue.pop_front();
+        space.notify_one();
+        return block;
+    }
+
+    // Valid once next() has returned nullptr
+    bool failed() const { return read_failed; }
+
+private:
+    istream& in;
+    size_t block_size;
+    size_t depth;
+    mutex guard;
+    condition_variable ready;
+    condition_variable space;
+    deque<shared_ptr<vector<unsigned char>>> queue;
+    bool stopping = false;
+    bool done = false;
+    bool read_failed = false;
+    thread worker;  // last, so it starts after the members it uses
+
+    void run() {
+        while (true) {
+            auto block = make_shared<vector<unsigned char>>(block_size);
+            in.read(reinterpret_cast<char*>(block->data()), block->size());
+            block->resize(static_cast<size_t>(in.gcount()));
+
+            unique_lock<mutex> lock(guard);
+            if (block->empty() || stopping) break;
+            queue.push_back(std::move(block));
+            ready.notify_one();
+            space.wait(lock, [this] { return queue.size() < depth || stopping; });
+            if (stopping) break;
+        }
+        lock_guard<mutex> lock(guard);
+        read_failed = in.bad();
+        done = true;
+        ready.notify_one();
+    }
+};
+
+// Options as the coders use them. Values outside the ranges given in
+// Shannon.h are clamped: below MIN_CODE_LENGTH_LIMIT the 256 symbols of a
+// block cannot get codes at all, above MAX_TABLE_CODE_LENGTH lengths no
+// longer fit the table fields, empty blocks would never cover the input
+// and the decoder rejects blocks above MAX_BLOCK_SIZE.
+EncodeOptions checkedOptions(EncodeOptions options) {
+    options.block_size = static_cast<size_t>(clamp<uint64_t>(options.block_size, 1, MAX_BLOCK_SIZE));
+    options.max_code_length = clamp(options.max_code_length, MIN_CODE_LENGTH_LIMIT, MAX_TABLE_CODE_LENGTH);
+    return options;
+}
+
+// Writes a container: blocks are coded on a pool and written in submission
+// order, so the output does not depend on the thread count. At most two
+// blocks per thread are in flight to keep memory bounded. Bytes are counted
+// here rather than asked from the stream so pipes work too. The pool and
+// scratch buffers are the writer's own unless a context lends its.
+class ContainerWriter {
+public:
+    ContainerWriter(ostream& out, const EncodeOptions& writer_options, uint64_t original_size = UNKNOWN_SIZE)
+        : ContainerWriter([&out](span<const unsigned char> bytes) {
+            out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            return static_cast<bool>(out);
+            }, writer_options, original_size) {}
+
+    ContainerWriter(ByteSink byte_sink, const EncodeOptions& writer_options, uint64_t original_size = UNKNOWN_SIZE,
+        ThreadPool* shared_pool = nullptr, ScratchPool<EncodeScratch>* shared_scratch = nullptr)
+        : sink(std::move(byte_sink)), options(checkedOptions(writer_options)),
+        own_scratch(shared_scratch ? nullptr : make_unique<ScratchPool<EncodeScratch>>()),
+        scratch(shared_scratch ? *shared_scratch : *own_scratch),
+        single(original_size <= options.block_size),
+        own_pool(shared_pool ? nullptr : make_unique<ThreadPool>(single ? 1 : options.threads)),
+        pool(shared_pool ? *shared_pool : *own_pool),
+        window(pool.size() * 2) {
+        // An input known to fit one block has nothing to index, and small
+        // payloads cannot spare the bytes. Its header gives the actual size
+        // as the block size, which is a byte or two less for small inputs.
+        indexed = !single;
+        if (options.verify && options.dictionary) verify_table.build(dictionaryCodes(*options.dictionary));
+        uint64_t block_size = single ? max<uint64_t>(1, original_size) : options.block_size;
+        vector<unsigned char> header(CONTAINER_MAGIC, CONTAINER_MAGIC + sizeof(CONTAINER_MAGIC));
+        header.push_back(FORMAT_VERSION);
+        header.push_back((indexed ? FLAG_BLOCK_INDEX : 0) | (original_size != UNKNOWN_SIZE ? FLAG_ORIGINAL_SIZE : 0)
+            | (options.dictionary ? FLAG_DICTIONARY : 0) | (options.block_checksums ? FLAG_BLOCK_CHECKSUM : 0)
+            | (options.stream_checksum ? FLAG_STREAM_CHECKSUM : 0));
+        putVarint(header, block_size);
+        if (original_size != UNKNOWN_SIZE) putVarint(header, original_size);
+        if (options.dictionary) putVarint(header, options.dictionary->id);
+        emit(header);
+    }
+
+    // Jobs refer to the writer, so none may outlive it even when finish()
+    // was never reached
+    ~ContainerWriter() {
+        for (auto& result : pending) result.wait();
+    }
+
+    // `owner` keeps the block's storage alive until it has been coded
+    void submit(span<const unsigned char> block, shared_ptr<vector<unsigned char>> owner = nullptr) {
+        if (pending.size() >= window) writeFront();
+        pending.push_back(pool.submit([this, block, owner] {
+            unique_ptr<EncodeScratch> buffers = scratch.acquire();
+            buffers->encoded.clear();
+            encodeBlock(block, buffers->encoded, options, *buffers);
+            if (options.verify) {
+                Clock::time_point mark = Clock::now();
+                if (!buffers->verify) buffers->verify = make_unique<DecodeScratch>();
+                buffers->verified = verifyBlock(block, buffers->encoded, *buffers->verify,
+                    options.dictionary ? &verify_table : nullptr);
+                buffers->stats.verify_seconds = lap(mark);
+            }
+            if (options.block_checksums || options.stream_checksum) {
+                buffers->checksum = crc32c(block);
+                if (options.block_checksums) putFixed32(buffers->encoded, buffers->checksum);
+            }
+            return buffers;
+            }, single));
+        raw_sizes.push_back(block.size());
+    }
+
+    // Drains pending blocks and writes the end marker, index and trailer
+    bool finish() {
+        while (!pending.empty()) writeFront();
+
+        vector<unsigned char> footer{ BLOCK_END };
+        if (options.stream_checksum) putFixed32(footer, checksum);
+        if (!indexed) {
+            emit(footer);
+            return ok;
+        }
+        uint64_t index_offset = written + footer.size();
+        putVarint(footer, index.size());
+        for (const auto& entry : index) {
+            putVarint(footer, entry.stored_size);
+            putVarint(footer, entry.raw_size);
+        }
+        for (int i = 0; i < 8; ++i) footer.push_back(static_cast<unsigned char>(index_offset >> (8 * i)));
+        footer.insert(footer.end(), TRAILER_MAGIC, TRAILER_MAGIC + sizeof(TRAILER_MAGIC));
+        emit(footer);
+        return ok;
+    }
+
+    uint64_t bytesWritten() const { return written; }
+    // After checkedOptions
+    size_t blockSize() const { return options.block_size; }
+    // With EncodeOptions::verify, a block written so far did not decode back
+    bool verifyFailed() const { return mismatched; }
+    // Blocks submitted before the first submit() has to wait for one
+    size_t inFlight() const { return window; }
+
+private:
+    ByteSink sink;
+    EncodeOptions options;
+    unique_ptr<ScratchPool<EncodeScratch>> own_scratch;
+    ScratchPool<EncodeScratch>& scratch;
+    bool single;    // the whole input is one block, coded on the calling thread
+    unique_ptr<ThreadPool> own_pool;
+    ThreadPool& pool;
+    size_t window;
+    deque<future<unique_ptr<EncodeScratch>>> pending;
+    deque<uint64_t> raw_sizes;
+    vector<IndexEntry> index;
+    uint64_t written = 0;
+    uint32_t checksum = 0;  // of the raw bytes written so far
+    DecodeTable verify_table;   // the dictionary's, for verification
+    bool indexed;
+    bool mismatched = false;
+    bool ok = true;
+
+    void emit(const vector<unsigned char>& bytes) {
+        Clock::time_point mark = Clock::now();
+        ok = sink(bytes) && ok;
+        written += bytes.size();
+        if (options.stats) {
+            options.stats->write_seconds += lap(mark);
+            options.stats->container_bytes += bytes.size();
+        }
+    }
+
+    void writeFront() {
+        unique_ptr<EncodeScratch> buffers = pending.front().get();
+        pending.pop_front();
+        if (options.stats) options.stats->add(buffers->stats);
+        if (!buffers->verified) {
+            mismatched = true;
+            ok = false;
+        }
+        if (options.stream_checksum) checksum = crc32cCombine(checksum, buffers->checksum, raw_sizes.front());
+        index.push_back({ buffers->encoded.size(), raw_sizes.front() });
+        raw_sizes.pop_front();
+        emit(buffers->encoded);
+        scratch.release(std::move(buffers));
+    }
+};
+
+// Codes a buffer that stays alive until the writer is finished
+bool encodeBuffer(span<const unsigned char> data, ContainerWriter& writer, size_t block_size) {
+    for (size_t offset = 0; offset < data.size(); offset += block_size) {
+        writer.submit(data.subspan(offset, min(block_size, data.size() - offset)));
+    }
+    return writer.finish();
+}
+
+}  // namespace detail
+
+struct EncodeContext::State {
+    EncodeOptions options;
+    unique_ptr<ThreadPool> pool;
+    ScratchPool<EncodeScratch> scratch;
+};
+
+EncodeContext::EncodeContext(const EncodeOptions& options) : state(make_unique<State>()) {
+    reset(options);
+}
+
+EncodeContext::~EncodeContext() = default;
+
+void EncodeContext::reset(const EncodeOptions& options) {
+    if (state->options.threads != options.threads) state->pool = nullptr;
+    state->options = checkedOptions(options);
+}
+
+// Threads are started by the first input of more than one block
+void EncodeContext::encode(span<const uint8_t> data, vector<uint8_t>& out) {
+    out.clear();
+    ThreadPool* pool = nullptr;
+    if (data.size() > state->options.block_size) {
+        if (!state->pool) state->pool = make_unique<ThreadPool>(state->options.threads);
+        pool = state->pool.get();
+    }
+    ContainerWriter writer([&out](span<const unsigned char> bytes) {
+        out.insert(out.end(), bytes.begin(), bytes.end());
+        return true;
+        }, state->options, data.size(), pool, &state->scratch);
+    if (!encodeBuffer(data, writer, state->options.block_size)) out.clear();
+}
+
+vector<uint8_t> encode(span<const uint8_t> data, const EncodeOptions& options) {
+    vector<uint8_t> out;
+    EncodeContext(options).encode(data, out);
+    return out;
+}
+
+bool encodeFile(const string& inputFile, const string& outputFile, const EncodeOptions& options,
+    uint64_t& original_size, uint64_t& compressed_size) {
+    // Mapped pages fault in during the histogram, so that is where most of
+    // the read time shows up
+    Clock::time_point mark = Clock::now();
+    MappedFile input;
+    if (!input.open(inputFile)) {
+        cerr << "Error: Cannot open input file!" << endl;
+        return false;
+    }
+    span<const unsigned char> data = input.bytes();
+    if (options.stats) options.stats->read_seconds += lap(mark);
+
+    ofstream out(outputFile, ios::binary);
+    if (!out) {
+        cerr << "Error: Cannot create output file!" << endl;
+        return false;
+    }
+
+    // Input pages are requested one writer window ahead of the block being
+    // submitted, and finished blocks are written from a thread of their own.
+    // An input of one block is coded on this thread, so it is written here
+    // too and a batch of small files starts no threads.
+    unique_ptr<WriteBehind> behind;
+    if (data.size() > checkedOptions(options).block_size) behind = make_unique<WriteBehind>(out);
+    bool ok, verify_failed;
+    {
+        ContainerWriter writer([&out, &behind](span<const unsigned char> bytes) {
+            if (behind) return behind->write(bytes);
+            out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            return static_cast<bool>(out);
+            }, options, data.size());
+        size_t block_size = writer.blockSize();
+        size_t ahead = writer.inFlight() * block_size;
+        input.prefetch(0, ahead);
+        for (size_t offset = 0; offset < data.size(); offset += block_size) {
+            input.prefetch(offset + ahead, block_size);
+            writer.submit(data.subspan(offset, min(block_size, data.size() - offset)));
+        }
+        ok = writer.finish();
+        compressed_size = writer.bytesWritten();
+        verify_failed = writer.verifyFailed();
+    }
+    mark = Clock::now();
+    ok = (behind ? behind->close() : static_cast<bool>(out.flush())) && ok;
+    if (options.stats) options.stats->write_seconds += lap(mark);
+    if (verify_failed) {
+        cerr << "Error: Verification failed, the output does not decode to the input!" << endl;
+        return false;
+    }
+    if (!ok) {
+        cerr << "Error: Failed while writing output file!" << endl;
+        return false;
+    }
+
+    original_size = data.size();
+    out.close();
+    return true;
+}
+
+namespace detail {
+
+// Single-pass encoder for inputs that cannot be mapped or seeked (pipes,
+// stdin). Only the blocks in flight are buffered, so peak memory is bounded
+// by block size times thread count no matter how large the input is.
+// Reading and writing overlap the coding; the read and write times are
+// the waits left over.
+bool encodeStream(istream& in, ostream& out, const EncodeOptions& options,
+    uint64_t& original_size, uint64_t& compressed_size) {
+    WriteBehind behind(out);
+    bool ok;
+    {
+        ContainerWriter writer([&behind](span<const unsigned char> bytes) {
+            return behind.write(bytes);
+            }, options);
+        ReadAhead reader(in, writer.blockSize());
+        original_size = 0;
+        while (true) {
+            Clock::time_point mark = Clock::now();
+            auto block = reader.next();
+            if (options.stats) options.stats->read_seconds += lap(mark);
+            if (!block) break;
+            writer.submit(*block, block);
+            original_size += block->size();
+        }
+        ok = writer.finish() && !reader.failed();
+        compressed_size = writer.bytesWritten();
+        if (writer.verifyFailed()) cerr << "Error: Verification failed, the output does not decode to the input!" << endl;
+    }
+    Clock::time_point mark = Clock::now();
+    ok = behind.close() && ok;
+    if (options.stats) options.stats->write_seconds += lap(mark);
+    return ok;
+}
+
+}  // namespace detail
+
+StreamEncoder::StreamEncoder(ostream& out, const EncodeOptions& options)
+    : writer(make_unique<ContainerWriter>(out, options)), block_size(writer->blockSize()) {}
+
+StreamEncoder::~StreamEncoder() = default;
+
+bool StreamEncoder::write(span<const uint8_t> data) {
+    while (!data.empty()) {
+        if (!block) {
+            block = make_shared<vector<unsigned char>>();
+            block->reserve(block_size);
+        }
+        size_t n = min(data.size(), block_size - block->size());
+        block->insert(block->end(), data.begin(), data.begin() + n);
+        data = data.subspan(n);
+        bytes_read += n;
+        if (block->size() == block_size) {
+            writer->submit(*block, block);
+            block = nullptr;
+        }
+    }
+    return true;
+}
+
+bool StreamEncoder::finish() {
+    if (block && !block->empty()) writer->submit(*block, block);
+    block = nullptr;
+    return writer->finish();
+}
+
+uint64_t StreamEncoder::bytesWritten() const {
+    return writer->bytesWritten();
+}
+
+bool encodeFileStreaming(const string& inputFile, const string& outputFile, const EncodeOptions& options,
+    uint64_t& original_size, uint64_t& compressed_size) {
+    ifstream in(inputFile, ios::binary);
+    if (!in) {
+        cerr << "Error: Cannot open input file!" << endl;
+        return false;
+    }
+
+    ofstream out(outputFile, ios::binary);
+    if (!out) {
+        cerr << "Error: Cannot create output file!" << endl;
+        return false;
+    }
+
+    if (!encodeStream(in, out, options, original_size, compressed_size)) {
+        cerr << "Error: Failed while encoding!" << endl;
+        return false;
+    }
+    out.close();
+    return true;
+}
+
+namespace detail {
+
+// Location of one block inside a container and of its bytes in the output
+struct BlockRef {
+    size_t offset;          // block header position in the container
+    size_t stored_size;     // header plus body
+    uint64_t raw_size;
+    uint64_t output_offset;
+};
+
+struct ContainerInfo {
+    uint8_t flags;
+    uint64_t block_size;
+    uint64_t original_size; // from the header, UNKNOWN_SIZE if absent
+    uint64_t dictionary_id; // with FLAG_DICTIONARY
+    uint32_t stream_checksum;   // with FLAG_STREAM_CHECKSUM
+    size_t blocks_offset;   // first block header
+    vector<BlockRef> blocks;
+    uint64_t total_size;
+};
+
+bool readStreamHeader(span<const unsigned char> data, ContainerInfo& info) {
+    size_t pos = sizeof(CONTAINER_MAGIC);
+    if (!isContainer(data) || data.size() < pos + 2 || data[pos] != FORMAT_VERSION) return false;
+    info.flags = data[pos + 1];
+    if (info.flags & ~KNOWN_FLAGS) return false;
+    pos += 2;
+    if (!getVarint(data, pos, info.block_size) || info.block_size == 0 || info.block_size > MAX_BLOCK_SIZE) return false;
+    info.original_size = UNKNOWN_SIZE;
+    if ((info.flags & FLAG_ORIGINAL_SIZE) && !getVarint(data, pos, info.original_size)) return false;
+    if ((info.flags & FLAG_DICTIONARY) && !getVarint(data, pos, info.dictionary_id)) return false;
+    info.blocks_offset = pos;
+    return true;
+}
+
+size_t blockChecksumSize(uint8_t flags) {
+    return (flags & FLAG_BLOCK_CHECKSUM) ? CHECKSUM_SIZE : 0;
+}
+
+// The end marker and the stream checksum after it
+size_t endMarkerSize(uint8_t flags) {
+    return 1 + ((flags & FLAG_STREAM_CHECKSUM) ? CHECKSUM_SIZE : 0);
+}
+
+// Reads the header of the block at `pos` and moves past its body and
+// checksum. The sizes have to be ones the mode can produce: a stored body
+// is the raw bytes and a run body is one byte.
+bool readBlockHeader(span<const unsigned char> data, size_t& pos, const ContainerInfo& info, uint64_t& raw_size) {
+    if (pos >= data.size()) return false;
+    uint8_t mode = data[pos++];
+    uint64_t body_size;
+    if (!getVarint(data, pos, raw_size) || !getVarint(data, pos, body_size)) return false;
+    size_t checksum_size = blockChecksumSize(info.flags);
+    if (mode == BLOCK_END || mode > BLOCK_TRANSFORMED || raw_size > info.block_size || body_size > data.size() - pos
+        || checksum_size > data.size() - pos - body_size) return false;
+    if ((mode == BLOCK_STORED && body_size != raw_size) || (mode == BLOCK_RUN && body_size != 1)) return false;
+    pos += static_cast<size_t>(body_size) + checksum_size;
+    return true;
+}
+
+// Builds the block list from the index in the trailer
+bool readBlockIndex(span<const unsigned char> data, ContainerInfo& info) {
+    size_t end_size = endMarkerSize(info.flags);
+    if (data.size() < info.blocks_offset + end_size + TRAILER_SIZE) return false;
+    size_t trailer = data.size() - TRAILER_SIZE;
+    if (memcmp(data.data() + trailer + 8, TRAILER_MAGIC, sizeof(TRAILER_MAGIC)) != 0) return false;
+    uint64_t index_offset = 0;
+    for (int i = 0; i < 8; ++i) index_offset |= static_cast<uint64_t>(data[trailer + i]) << (8 * i);
+    if (index_offset < info.blocks_offset + end_size || index_offset > trailer) return false;
+    uint64_t blocks_end = index_offset - end_size;
+    if (data[blocks_end] != BLOCK_END) return false;
+    if (info.flags & FLAG_STREAM_CHECKSUM) info.stream_checksum = getFixed32(data.data() + blocks_end + 1);
+
+    auto index = data.first(trailer);
+    size_t pos = static_cast<size_t>(index_offset);
+    uint64_t count;
+    if (!getVarint(index, pos, count) || count > index.size()) return false;
+
+    uint64_t offset = info.blocks_offset, output_offset = 0;
+    info.blocks.clear();
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t stored_size, raw_size;
+        if (!getVarint(index, pos, stored_size) || !getVarint(index, pos, raw_size)) return false;
+        // Only the sizes are checked here; a block's header is read when
+        // the block is decoded, so a range decode touches no other blocks
+        if (stored_size > blocks_end - offset || stored_size < MIN_BLOCK_HEADER_SIZE + blockChecksumSize(info.flags)
+            || raw_size > info.block_size) return false;
+        info.blocks.push_back({ static_cast<size_t>(offset), static_cast<size_t>(stored_size), raw_size, output_offset });
+        offset += stored_size;
+        output_offset += raw_size;
+    }
+    info.total_size = output_offset;
+    return pos == trailer && offset == blocks_end;
+}
+
+// Builds the block list by walking the block headers, for containers
+// without an index
+bool scanBlocks(span<const unsigned char> data, ContainerInfo& info) {
+    size_t pos = info.blocks_offset;
+    uint64_t output_offset = 0;
+    info.blocks.clear();
+    while (pos < data.size()) {
+        size_t start = pos;
+        if (data[pos] == BLOCK_END) {
+            info.total_size = output_offset;
+            if (data.size() - pos != endMarkerSize(info.flags)) return false;
+            if (info.flags & FLAG_STREAM_CHECKSUM) info.stream_checksum = getFixed32(data.data() + pos + 1);
+            return true;
+        }
+        uint64_t raw_size;
+        if (!readBlockHeader(data, pos, info, raw_size)) return false;
+        info.blocks.push_back({ start, pos - start, raw_size, output_offset });
+        output_offset += raw_size;
+    }
+    return false;
+}
+
+// A declared original size must agree with the blocks, so a truncated or
+// spliced file is rejected before anything is decoded
+bool readContainer(span<const unsigned char> data, ContainerInfo& info) {
+    if (!readStreamHeader(data, info)) return false;
+    bool ok = (info.flags & FLAG_BLOCK_INDEX) ? readBlockIndex(data, info) : scanBlocks(data, info);
+    return ok && (info.original_size == UNKNOWN_SIZE || info.original_size == info.total_size);
+}
+
+// Builds the table for the dictionary a container was coded with. Fails
+// when the caller's dictionary is missing or has another ID.
+bool sharedTable(const ContainerInfo& info, const Dictionary* dictionary, DecodeTable& table) {
+    if (!(info.flags & FLAG_DICTIONARY)) return true;
+    return dictionary && dictionary->id == info.dictionary_id && table.build(dictionaryCodes(*dictionary));
+}
+
+// Decodes one block given its location; the header is checked against the
+// index and the mode, as in readBlockHeader, and the block checksum, if any,
+// against the output. `checksum` gets
+// the CRC32C of the output when the container carries checksums.
+bool decodeBlockAt(span<const unsigned char> data, uint8_t flags, const BlockRef& ref, unsigned char* out,
+    DecodeScratch& scratch, const DecodeTable* dictionary, uint32_t& checksum) {
+    auto block = data.subspan(ref.offset, ref.stored_size);
+    size_t checksum_size = blockChecksumSize(flags);
+    size_t pos = 1;
+    uint64_t raw_size, body_size;
+    if (block.empty() || !getVarint(block, pos, raw_size) || !getVarint(block, pos, body_size)) return false;
+    if (raw_size != ref.raw_size || block.size() - pos < checksum_size || body_size != block.size() - pos - checksum_size) {
+        return false;
+    }
+    uint8_t mode = block[0];
+    if (mode == BLOCK_END || mode > BLOCK_TRANSFORMED || (mode == BLOCK_STORED && body_size != raw_size)
+        || (mode == BLOCK_RUN && body_size != 1)) return false;
+    size_t size = static_cast<size_t>(raw_size);
+    if (!decodeBlock(mode, block.subspan(pos, body_size), out, size, scratch, dictionary)) return false;
+    if (!(flags & (FLAG_BLOCK_CHECKSUM | FLAG_STREAM_CHECKSUM))) return true;
+    checksum = crc32c(span<const unsigned char>(out, size));
+    return !checksum_size || checksum == getFixed32(block.data() + block.size() - checksum_size);
+}
+
+using BlockDone = function<void(size_t)>;
+
+// Decodes output bytes [offset, offset + length) into `out` on the pool,
+// touching only the blocks that overlap them. Blocks inside the range are
+// decoded in place; the one or two it clips go through their scratch buffer.
+// Checksums are computed by the jobs; the stream checksum is only checked
+// when the range covers everything. `completed` sees the index of each
+// decoded block, in order.
+bool decodeBlocks(span<const unsigned char> data, const ContainerInfo& info, unsigned char* out,
+    uint64_t offset, uint64_t length, ThreadPool& pool, ScratchPool<DecodeScratch>& scratch,
+    const DecodeTable* dictionary, CodingStats* stats = nullptr, const BlockDone& completed = nullptr) {
+    uint64_t end = offset + length;
+    auto first = upper_bound(info.blocks.begin(), info.blocks.end(), offset, [](uint64_t value, const BlockRef& ref) {
+        return value < ref.output_offset;
+        });
+    if (first != info.blocks.begin()) --first;
+
+    bool check_stream = offset == 0 && length == info.total_size && (info.flags & FLAG_STREAM_CHECKSUM);
+    auto next = first == info.blocks.end() ? first : first + 1;
+    bool single = next == info.blocks.end() || next->output_offset >= end;
+    vector<uint32_t> checksums(check_stream ? info.blocks.size() : 0);
+    mutex stats_guard;
+    vector<future<bool>> results;
+    for (auto it = first; it != info.blocks.end() && it->output_offset < end; ++it) {
+        const BlockRef& ref = *it;
+        if (ref.output_offset + ref.raw_size <= offset) continue;
+        uint32_t* checksum = check_stream ? &checksums[it - info.blocks.begin()] : nullptr;
+        results.push_back(pool.submit([&data, &info, &ref, out, offset, end, &scratch, dictionary, stats, &stats_guard,
+            checksum] {
+            unique_ptr<DecodeScratch> buffers = scratch.acquire();
+            buffers->collect = stats != nullptr;
+            uint64_t from = max(offset, ref.output_offset);
+            uint64_t to = min(end, ref.output_offset + ref.raw_size);
+            uint32_t block_checksum = 0;
+            bool ok;
+            if (from == ref.output_offset && to == ref.output_offset + ref.raw_size) {
+                ok = decodeBlockAt(data, info.flags, ref, out + (ref.output_offset - offset), *buffers, dictionary,
+                    block_checksum);
+            }
+            else {
+                auto& decoded = buffers->decoded;
+                decoded.resize(static_cast<size_t>(ref.raw_size));
+                ok = decodeBlockAt(data, info.flags, ref, decoded.data(), *buffers, dictionary, block_checksum);
+                if (ok) memcpy(out + (from - offset), decoded.data() + (from - ref.output_offset), static_cast<size_t>(to - from));
+            }
+            if (checksum) *checksum = block_checksum;
+            if (ok && stats) {
+                lock_guard<mutex> lock(stats_guard);
+                stats->add(buffers->stats);
+            }
+            scratch.release(std::move(buffers));
+            return ok;
+            }, single));
+    }
+    bool ok = true;
+    size_t block = static_cast<size_t>(first - info.blocks.begin());
+    for (auto& result : results) {
+        ok = result.get() && ok;
+        if (ok && completed) completed(block);
+        ++block;
+    }
+    if (ok && check_stream) {
+        uint32_t stream = 0;
+        for (size_t i = 0; i < checksums.size(); ++i) stream = crc32cCombine(stream, checksums[i], info.blocks[i].raw_size);
+        ok = stream == info.stream_checksum;
+    }
+    if (stats) stats->container_bytes += data.size();
+    return ok;
+}
+
+bool decodeBlocks(span<const unsigned char> data, const ContainerInfo& info, unsigned char* out,
+    uint64_t offset, uint64_t length, unsigned threads, const Dictionary* dictionary, CodingStats* stats = nullptr,
+    const BlockDone& completed = nullptr) {
+    DecodeTable table;
+    if (!sharedTable(info, dictionary, table)) return false;
+    // A lone block is decoded on the calling thread, as in DecodeContext
+    ThreadPool pool(info.blocks.size() > 1 ? threads : 1);
+    ScratchPool<DecodeScratch> scratch;
+    return decodeBlocks(data, info, out, offset, length, pool, scratch,
+        (info.flags & FLAG_DICTIONARY) ? &table : nullptr, stats, completed);
+}
+
+// Files written before the container format: a native size_t symbol count,
+// byte-padded symbol/length/code entries and one bitstream up to EOF
+bool decodeLegacy(span<const unsigned char> data, ostream& out) {
+    size_t symbol_count = 0;
+    size_t pos = sizeof(symbol_count);
+    if (data.size() < pos) return false;
+    memcpy(&symbol_count, data.data(), sizeof(symbol_count));
+
+    vector<SymbolInfo> codes;
+    for (size_t i = 0; i < symbol_count; ++i) {
+        SymbolInfo info{};
+        if (data.size() - pos < 2) return false;
+        info.symbol = data[pos++];
+        info.length = data[pos++];
+        size_t code_bytes = (info.length + 7) / 8;
+        if (info.length > MAX_CODE_LENGTH || data.size() - pos < code_bytes) return false;
+
+        for (size_t j = 0; j < code_bytes; ++j) {
+            int bits = min(8, info.length - static_cast<int>(j) * 8);
+            info.code = (info.code << bits) | (data[pos++] >> (8 - bits));
+        }
+        // A bit-serial matcher never matched an empty code
+        if (info.length > 0) codes.push_back(info);
+    }
+
+    if (codes.empty()) return true;
+    DecodeTable table;
+    if (!table.build(codes)) return false;
+
+    // The payload is decoded straight from the mapping in fixed-size chunks
+    BitReader reader(data.data() + pos, data.size() - pos);
+    vector<unsigned char> chunk(1 << 20);
+    size_t produced;
+    do {
+        produced = table.decode(reader, chunk.data(), chunk.size());
+        out.write(reinterpret_cast<const char*>(chunk.data()), produced);
+    } while (produced == chunk.size());
+    return true;
+}
+
+}  // namespace detail
+
+struct DecodeContext::State {
+    unsigned threads = 0;
+    unique_ptr<ThreadPool> pool;    // started by the first container of several blocks
+    ThreadPool serial{ 1 };
+    ScratchPool<DecodeScratch> scratch;
+    ContainerInfo info;
+    const Dictionary* dictionary = nullptr;
+    DecodeTable shared;
+    // What `shared` was built from. Callers may load another dictionary into
+    // the same object, so the contents are compared rather than the pointer.
+    Dictionary shared_source;
+    bool shared_built = false;
+};
+
+DecodeContext::DecodeContext(unsigned threads, const Dictionary* dictionary) : state(make_unique<State>()) {
+    reset(threads, dictionary);
+}
+
+DecodeContext::~DecodeContext() = default;
+
+void DecodeContext::reset(unsigned threads, const Dictionary* dictionary) {
+    if (state->threads != threads) {
+        state->pool = nullptr;
+        state->threads = threads;
+    }
+    state->dictionary = dictionary;
+}
+
+bool DecodeContext::decode(span<const uint8_t> data, vector<uint8_t>& out, CodingStats* stats) {
+    out.clear();
+    if (!isContainer(data)) {
+        ostringstream legacy;
+        if (!decodeLegacy(data, legacy)) return false;
+        string bytes = std::move(legacy).str();
+        out.assign(bytes.begin(), bytes.end());
+        return true;
+    }
+    return decodeRange(data, 0, UNKNOWN_SIZE, out, stats);
+}
+
+bool DecodeContext::decodeRange(span<const uint8_t> data, uint64_t offset, uint64_t length, vector<uint8_t>& out,
+    CodingStats* stats) {
+    out.clear();
+    ContainerInfo& info = state->info;
+    if (!readContainer(data, info)) return false;
+
+    const DecodeTable* shared = nullptr;
+    if (info.flags & FLAG_DICTIONARY) {
+        const Dictionary* dictionary = state->dictionary;
+        if (!dictionary || dictionary->id != info.dictionary_id) return false;
+        bool current = state->shared_built && state->shared_source.id == dictionary->id
+            && state->shared_source.lengths == dictionary->lengths;
+        if (!current) {
+            state->shared_built = false;
+            if (!sharedTable(info, dictionary, state->shared)) return false;
+            state->shared_source = *dictionary;
+            state->shared_built = true;
+        }
+        shared = &state->shared;
+    }
+    offset = min(offset, info.total_size);
+    length = min(length, info.total_size - offset);
+    // A few bytes of run blocks can name more output than fits in memory;
+    // that is reported as a failure like corruption rather than thrown
+    try {
+        out.resize(static_cast<size_t>(length));
+    }
+    catch (const bad_alloc&) {
+        out = {};
+        return false;
+    }
+    if (info.blocks.size() > 1 && !state->pool) state->pool = make_unique<ThreadPool>(state->threads);
+    ThreadPool& pool = info.blocks.size() > 1 ? *state->pool : state->serial;
+    return decodeBlocks(data, info, out.data(), offset, length, pool, state->scratch, shared, stats);
+}
+
+bool decode(span<const uint8_t> data, vector<uint8_t>& out, unsigned threads, const Dictionary* dictionary,
+    CodingStats* stats) {
+    return DecodeContext(threads, dictionary).decode(data, out, stats);
+}
+
+bool decodeRange(span<const uint8_t> data, uint64_t offset, uint64_t length, vector<uint8_t>& out, unsigned threads,
+    const Dictionary* dictionary) {
+    return DecodeContext(threads, dictionary).decodeRange(data, offset, length, out);
+}
+
+// Longest possible stream header: magic, version, flags and three varints
+constexpr size_t MAX_STREAM_HEADER = sizeof(CONTAINER_MAGIC) + 2 + 3 * 10;
+
+StreamDecoder::StreamDecoder(ostream& output, const Dictionary* shared_dictionary)
+    : out(output), dictionary(shared_dictionary), scratch(make_unique<DecodeScratch>()) {}
+
+StreamDecoder::~StreamDecoder() = default;
+
+// Consumes the stream header or one block from `input` past `consumed`.
+// Returns false when more input is needed; corruption also sets `failed`.
+bool StreamDecoder::step() {
+    auto data = span<const unsigned char>(input).subspan(consumed);
+    size_t pos = 0;
+    if (!header_read) {
+        ContainerInfo info;
+        if (!readStreamHeader(data, info)) {
+            failed = data.size() >= MAX_STREAM_HEADER || (data.size() >= sizeof(CONTAINER_MAGIC) && !isContainer(data));
+            return false;
+        }
+        if (info.flags & FLAG_DICTIONARY) {
+            shared_table = make_unique<DecodeTable>();
+            if (!sharedTable(info, dictionary, *shared_table)) {
+                failed = true;
+                return false;
+            }
+        }
+        header_read = true;
+        flags = info.flags;
+        block_size = info.block_size;
+        original_size = info.original_size;
+        pos = info.blocks_offset;
+    }
+    else {
+        if (data.empty()) return false;
+        uint8_t mode = data[pos++];
+        if (mode == BLOCK_END) {
+            if (flags & FLAG_STREAM_CHECKSUM) {
+                if (data.size() - pos < CHECKSUM_SIZE) return false;
+                failed = getFixed32(data.data() + pos) != checksum;
+            }
+            ended = true;
+            input.clear();
+            consumed = 0;
+            return false;
+        }
+        uint64_t raw_size, body_size;
+        if (!getVarint(data, pos, raw_size) || !getVarint(data, pos, body_size)) {
+            failed = data.size() >= 1 + 10 + 10;
+            return false;
+        }
+        if (raw_size > block_size) {
+            failed = true;
+            return false;
+        }
+        size_t checksum_size = blockChecksumSize(flags);
+        if (body_size > data.size() - pos || checksum_size > data.size() - pos - body_size) return false;
+
+        auto& decoded = scratch->decoded;
+        decoded.resize(static_cast<size_t>(raw_size));
+        if (!decodeBlock(mode, data.subspan(pos, static_cast<size_t>(body_size)), decoded.data(), decoded.size(),
+            *scratch, shared_table.get())) {
+            failed = true;
+            return false;
+        }
+        pos += static_cast<size_t>(body_size);
+        if (flags & (FLAG_BLOCK_CHECKSUM | FLAG_STREAM_CHECKSUM)) {
+            uint32_t block_checksum = crc32c(decoded);
+            if (checksum_size && block_checksum != getFixed32(data.data() + pos)) {
+                failed = true;
+                return false;
+            }
+            checksum = crc32cCombine(checksum, block_checksum, decoded.size());
+            pos += checksum_size;
+        }
+        out.write(reinterpret_cast<const char*>(decoded.data()), decoded.size());
+        bytes_written += decoded.size();
+    }
+    consumed += pos;
+    return true;
+}
+
+bool StreamDecoder::write(span<const uint8_t> data) {
+    if (failed) return false;
+    // The index and trailer after the end marker are not needed
+    if (ended) return true;
+    input.insert(input.end(), data.begin(), data.end());
+    while (step()) {}
+    // Decoded blocks are dropped once per write rather than after each one
+    input.erase(input.begin(), input.begin() + consumed);
+    consumed = 0;
+    return !failed && static_cast<bool>(out);
+}
+
+bool StreamDecoder::finish() {
+    return !failed && ended && (original_size == UNKNOWN_SIZE || original_size == bytes_written) && static_cast<bool>(out);
+}
+
+bool decodeFile(const string& inputFile, const string& outputFile, unsigned threads, const Dictionary* dictionary,
+    CodingStats* stats) {
+    Clock::time_point mark = Clock::now();
+    MappedFile input;
+    if (!input.open(inputFile)) {
+        cerr << "Error: Cannot open input file!" << endl;
+        return false;
+    }
+    span<const unsigned char> data = input.bytes();
+    if (stats) stats->read_seconds += lap(mark);
+
+    if (isContainer(data)) {
+        ContainerInfo info;
+        if (!readContainer(data, info)) {
+            cerr << "Error: Corrupted input file!" << endl;
+            return false;
+        }
+        if ((info.flags & FLAG_DICTIONARY) && (!dictionary || dictionary->id != info.dictionary_id)) {
+            cerr << "Error: Input was coded with dictionary " << info.dictionary_id << "!" << endl;
+            return false;
+        }
+        MappedOutput out;
+        if (!out.create(outputFile, static_cast<size_t>(info.total_size))) {
+            cerr << "Error: Cannot create output file!" << endl;
+            return false;
+        }
+        // Jobs run in block order, so inputs are fetched a window ahead of the
+        // last block written back and every finished block starts writeback
+        size_t ahead = max<size_t>(1, threads) * 2;
+        auto fetch = [&input, &info](size_t block) {
+            if (block < info.blocks.size()) input.prefetch(info.blocks[block].offset, info.blocks[block].stored_size);
+            };
+        for (size_t i = 0; i < ahead; ++i) fetch(i);
+        auto completed = [&](size_t block) {
+            fetch(block + ahead);
+            const BlockRef& ref = info.blocks[block];
+            out.flush(static_cast<size_t>(ref.output_offset), static_cast<size_t>(ref.raw_size));
+            };
+        if (!decodeBlocks(data, info, out.data(), 0, info.total_size, threads, dictionary, stats, completed)) {
+            cerr << "Error: Corrupted input file!" << endl;
+            return false;
+        }
+        // Stores into the mapping are the write; this waits for what is left
+        mark = Clock::now();
+        if (!out.close()) {
+            cerr << "Error: Failed while writing output file!" << endl;
+            return false;
+        }
+        if (stats) stats->write_seconds += lap(mark);
+    }
+    else {
+        ofstream out(outputFile, ios::binary);
+        if (!out) {
+            cerr << "Error: Cannot create output file!" << endl;
+            return false;
+        }
+        if (!decodeLegacy(data, out)) {
+            cerr << "Error: Corrupted input file!" << endl;
+            return false;
+        }
+        out.close();
+    }
+    return true;
+}
+
+bool decodeFileRange(const string& inputFile, ostream& out, uint64_t offset, uint64_t length, unsigned threads,
+    const Dictionary* dictionary) {
+    MappedFile input;
+    if (!input.open(inputFile)) {
+        cerr << "Error: Cannot open input file!" << endl;
+        return false;
+    }
+    span<const unsigned char> data = input.bytes();
+    // The original format is one bitstream without seek points
+    if (!isContainer(data)) {
+        cerr << "Error: Input has no blocks to seek to!" << endl;
+        return false;
+    }
+    ContainerInfo info;
+    if (readStreamHeader(data, info) && (info.flags & FLAG_DICTIONARY)
+        && (!dictionary || dictionary->id != info.dictionary_id)) {
+        cerr << "Error: Input was coded with dictionary " << info.dictionary_id << "!" << endl;
+        return false;
+    }
+    vector<uint8_t> range;
+    if (!decodeRange(data, offset, length, range, threads, dictionary)) {
+        cerr << "Error: Corrupted input file!" << endl;
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(range.data()), range.size());
+    if (!out) {
+        cerr << "Error: Failed while writing output file!" << endl;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace shannon
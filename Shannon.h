@@ -0,0 +1,219 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+// Public interface of the Shannon coder. Everything works on memory buffers
+// or streams; the interactive program in main.cpp is one client of it.
+// All of it is in namespace shannon; the internals are in shannon::detail.
+
+namespace shannon {
+
+constexpr size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+
+// Code tables store lengths in 5 bits
+constexpr int MAX_TABLE_CODE_LENGTH = 31;
+// 256 symbols need lengths of up to 8 bits
+constexpr int MIN_CODE_LENGTH_LIMIT = 8;
+// Width of the decoder's root table: codes no longer than this decode in one
+// lookup from an 8 KiB table
+constexpr int DEFAULT_MAX_CODE_LENGTH = 11;
+
+enum Backend : uint8_t {
+    BACKEND_PREFIX,     // best of Shannon, Huffman and order-1 prefix codes
+    BACKEND_RANS,       // interleaved rANS
+};
+
+// Reversible passes over a block before entropy coding. Each block records
+// the ones it was coded with, and blocks that code smaller without them are
+// left alone.
+enum Transform : uint8_t {
+    TRANSFORM_RLE = 0x01,   // four equal bytes are followed by a count of further repeats
+    TRANSFORM_BWT = 0x02,   // Burrows-Wheeler then move-to-front, before RLE when both are set
+};
+
+unsigned defaultThreadCount();
+
+// Shared code table for payloads too small to carry their own. Containers
+// coded with one record its ID, and decoding needs the same dictionary.
+struct Dictionary {
+    uint32_t id = 0;
+    std::array<uint8_t, 256> lengths{};     // canonical code lengths, every byte has a code
+};
+
+// Builds a dictionary from sample payloads; bytes missing from the samples
+// still get (long) codes. `max_code_length` is clamped as in EncodeOptions.
+Dictionary trainDictionary(const std::vector<std::span<const uint8_t>>& samples,
+    int max_code_length = DEFAULT_MAX_CODE_LENGTH);
+bool saveDictionary(const std::string& path, const Dictionary& dictionary);
+bool loadDictionary(const std::string& path, Dictionary& dictionary);
+
+// Stage timings and counters, filled in when a coder is given one. Block
+// stages are summed over worker threads, so with several threads they can
+// exceed the wall time; read and write are measured on the calling thread.
+struct CodingStats {
+    double read_seconds = 0;
+    double histogram_seconds = 0;
+    double table_seconds = 0;       // building (encode) or reading (decode) code tables
+    double code_seconds = 0;        // payload encoding or decoding
+    double transform_seconds = 0;   // block transforms or their inverses
+    double verify_seconds = 0;      // decoding blocks again with EncodeOptions::verify
+    double write_seconds = 0;
+    uint64_t raw_bytes = 0;
+    uint64_t container_bytes = 0;
+    uint64_t stored_bytes = 0;      // raw bytes kept in stored blocks
+    uint64_t symbols = 0;           // raw bytes in entropy-coded blocks
+    uint64_t payload_bits = 0;      // their coded size without tables
+    uint64_t table_bits = 0;
+    double entropy_bits = 0;        // order-0 entropy of each block, summed
+    uint64_t table_lookups = 0;     // decoder: symbols of order-0 prefix blocks
+    uint64_t table_misses = 0;      // of those, codes too long for the root table
+
+    void add(const CodingStats& other);
+};
+
+struct EncodeOptions {
+    unsigned threads = defaultThreadCount();
+    size_t block_size = DEFAULT_BLOCK_SIZE;     // 1 byte to 1 GiB; other values are clamped
+    bool order1 = false;    // allow order-1 context blocks where they are smaller
+    Backend backend = BACKEND_PREFIX;
+    // From MIN_CODE_LENGTH_LIMIT to MAX_TABLE_CODE_LENGTH; other values are clamped
+    int max_code_length = DEFAULT_MAX_CODE_LENGTH;
+    const Dictionary* dictionary = nullptr;     // lets prefix blocks skip their tables
+    bool interleaved = false;   // split prefix blocks into 4 streams that decode in parallel on one core
+    uint8_t transforms = 0;     // Transform bits
+    // CRC32C of every raw block and of the whole input, checked on decode
+    bool block_checksums = false;
+    bool stream_checksum = false;
+    // Decode every block on its worker right after coding it and fail the
+    // encode when it does not give the input back
+    bool verify = false;
+    CodingStats* stats = nullptr;
+};
+
+// Whole-buffer coding. decode() accepts containers and the original format
+// and returns false on corrupted input. encode() returns nothing when
+// verification fails.
+std::vector<uint8_t> encode(std::span<const uint8_t> data, const EncodeOptions& options = {});
+bool decode(std::span<const uint8_t> data, std::vector<uint8_t>& out, unsigned threads = defaultThreadCount(),
+    const Dictionary* dictionary = nullptr, CodingStats* stats = nullptr);
+// Decodes only the blocks overlapping [offset, offset + length); see
+// DecodeContext::decodeRange
+bool decodeRange(std::span<const uint8_t> data, uint64_t offset, uint64_t length, std::vector<uint8_t>& out,
+    unsigned threads = defaultThreadCount(), const Dictionary* dictionary = nullptr);
+
+namespace detail {
+class ContainerWriter;
+class DecodeTable;
+struct DecodeScratch;
+}
+
+// Reusable coders for services that code many buffers. A context keeps its
+// worker threads and every per-block buffer (histograms, code and decode
+// tables, bit buffers) between calls, so once warmed up a call allocates
+// only a few small job records per block. `out` is overwritten and its
+// capacity reused. One context serves one call at a time.
+class EncodeContext {
+public:
+    explicit EncodeContext(const EncodeOptions& options = {});
+    ~EncodeContext();
+
+    // Keeps the buffers; threads are replaced only when their count changes
+    void reset(const EncodeOptions& options);
+    void encode(std::span<const uint8_t> data, std::vector<uint8_t>& out);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+class DecodeContext {
+public:
+    explicit DecodeContext(unsigned threads = defaultThreadCount(), const Dictionary* dictionary = nullptr);
+    ~DecodeContext();
+
+    void reset(unsigned threads, const Dictionary* dictionary = nullptr);
+    bool decode(std::span<const uint8_t> data, std::vector<uint8_t>& out, CodingStats* stats = nullptr);
+    // Original bytes [offset, offset + length), clipped to the end. Only the
+    // blocks overlapping them are decoded; the original format is rejected.
+    bool decodeRange(std::span<const uint8_t> data, uint64_t offset, uint64_t length, std::vector<uint8_t>& out,
+        CodingStats* stats = nullptr);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+// Incremental encoder: input of any size is cut into blocks as it arrives
+// and the container is written to `out`. The blocks match encode() on the
+// concatenated input, but the header carries no original size.
+class StreamEncoder {
+public:
+    explicit StreamEncoder(std::ostream& out, const EncodeOptions& options = {});
+    ~StreamEncoder();
+
+    bool write(std::span<const uint8_t> data);
+    // Writes the last block, the end marker and the index
+    bool finish();
+
+    uint64_t bytesRead() const { return bytes_read; }
+    uint64_t bytesWritten() const;
+
+private:
+    std::unique_ptr<detail::ContainerWriter> writer;
+    std::shared_ptr<std::vector<uint8_t>> block;
+    size_t block_size;
+    uint64_t bytes_read = 0;
+};
+
+// Incremental container decoder: blocks are decoded and written to `out` as
+// soon as they are complete, so only one block is buffered at a time.
+class StreamDecoder {
+public:
+    explicit StreamDecoder(std::ostream& output, const Dictionary* dictionary = nullptr);
+    ~StreamDecoder();
+
+    bool write(std::span<const uint8_t> data);
+    // Fails unless the end marker has been seen and the sizes agree
+    bool finish();
+
+    uint64_t bytesWritten() const { return bytes_written; }
+
+private:
+    std::ostream& out;
+    const Dictionary* dictionary;
+    std::unique_ptr<detail::DecodeTable> shared_table;     // set once the header names a dictionary
+    std::unique_ptr<detail::DecodeScratch> scratch;
+    std::vector<uint8_t> input;
+    size_t consumed = 0;     // bytes at the front of `input` already decoded
+    bool header_read = false;
+    bool ended = false;
+    bool failed = false;
+    uint8_t flags = 0;
+    uint64_t block_size = 0;
+    uint64_t original_size = 0;
+    uint64_t bytes_written = 0;
+    uint32_t checksum = 0;     // of the output so far
+
+    bool step();
+};
+
+// File front ends; errors are reported on cerr
+bool encodeFile(const std::string& inputFile, const std::string& outputFile, const EncodeOptions& options,
+    uint64_t& original_size, uint64_t& compressed_size);
+// Bounded-memory variant for inputs that cannot be mapped (pipes, stdin)
+bool encodeFileStreaming(const std::string& inputFile, const std::string& outputFile, const EncodeOptions& options,
+    uint64_t& original_size, uint64_t& compressed_size);
+bool decodeFile(const std::string& inputFile, const std::string& outputFile, unsigned threads = defaultThreadCount(),
+    const Dictionary* dictionary = nullptr, CodingStats* stats = nullptr);
+// Writes one slice of the original file to `out`
+bool decodeFileRange(const std::string& inputFile, std::ostream& out, uint64_t offset, uint64_t length,
+    unsigned threads = defaultThreadCount(), const Dictionary* dictionary = nullptr);
+
+}  // namespace shannon
@@ -0,0 +1,270 @@
+// Per-stage benchmarks. The stages are internal to Shannon.cpp, so it is
+// compiled into this file rather than linked:
+//   g++ -O2 -std=c++20 -pthread bench/shannon_benchmark.cpp -lbenchmark -o shannon_benchmark
+// Run from the repository root so the text corpus finds exp.txt. The 1 GB
+// inputs need a few GB of memory; skip them with
+//   --benchmark_filter=-/1073741824
+// Add -DSHANNON_NO_BMI2 for a build without the BMI2 kernels to compare.
+#include "../Shannon.cpp"
+
+#include <benchmark/benchmark.h>
+
+#include <bit>
+#include <random>
+
+using namespace shannon;
+using namespace shannon::detail;
+
+enum Corpus {
+    CORPUS_TEXT,
+    CORPUS_RANDOM,
+    CORPUS_SKEWED,
+    CORPUS_BINARY,
+};
+
+const char* corpusName(int corpus) {
+    static const char* names[] = { "text", "random", "skewed", "binary" };
+    return names[corpus];
+}
+
+vector<unsigned char> generateCorpus(int corpus, size_t size) {
+    vector<unsigned char> data;
+    data.reserve(size);
+    mt19937_64 rng(corpus);
+    switch (corpus) {
+    case CORPUS_TEXT: {
+        // exp.txt repeated; a pangram stands in when it is missing
+        ifstream in("exp.txt", ios::binary);
+        string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        if (text.empty()) text = "The quick brown fox jumps over the lazy dog. ";
+        while (data.size() < size) data.insert(data.end(), text.begin(), text.begin() + min(text.size(), size - data.size()));
+        break;
+    }
+    case CORPUS_RANDOM:
+        while (data.size() < size) data.push_back(static_cast<unsigned char>(rng()));
+        break;
+    case CORPUS_SKEWED:
+        // Geometric: byte k with probability 2^-(k+1)
+        while (data.size() < size) data.push_back(static_cast<unsigned char>(countr_zero(rng() | (uint64_t(1) << 63))));
+        break;
+    case CORPUS_BINARY:
+        // Fixed-size records: a counter, a small value and a float
+        for (uint32_t i = 0; data.size() < size; ++i) {
+            unsigned char record[12];
+            uint32_t small = static_cast<uint32_t>(rng() % 1000);
+            float value = static_cast<float>(i) * 0.25f;
+            memcpy(record, &i, 4);
+            memcpy(record + 4, &small, 4);
+            memcpy(record + 8, &value, 4);
+            data.insert(data.end(), record, record + min(sizeof(record), size - data.size()));
+        }
+        break;
+    }
+    return data;
+}
+
+// Only the most recent corpus is kept, so the 1 GB inputs are never held
+// side by side
+span<const unsigned char> corpus(benchmark::State& state) {
+    static int cached_corpus = -1;
+    static size_t cached_size = 0;
+    static vector<unsigned char> cached;
+    int kind = static_cast<int>(state.range(0));
+    size_t size = state.range(1) ? static_cast<size_t>(state.range(1)) : size_t(1) << 20;
+    if (kind != cached_corpus || size != cached_size) {
+        cached.clear();
+        cached.shrink_to_fit();
+        cached = generateCorpus(kind, size);
+        cached_corpus = kind;
+        cached_size = size;
+    }
+    state.SetLabel(corpusName(kind));
+    return cached;
+}
+
+// Wall time of the measured loop, for cycles/byte at the nominal clock
+class LoopTimer {
+public:
+    LoopTimer() : start(chrono::steady_clock::now()) {}
+
+    // MB/s comes from the bytes processed
+    void report(benchmark::State& state, size_t bytes_per_iteration) const {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double bytes = static_cast<double>(bytes_per_iteration) * state.iterations();
+        state.SetBytesProcessed(static_cast<int64_t>(bytes));
+        state.counters["cycles/byte"] = seconds * benchmark::CPUInfo::Get().cycles_per_second / max(1.0, bytes);
+    }
+
+private:
+    chrono::steady_clock::time_point start;
+};
+
+// The codes encodeBlock would use for a Shannon block of `data`
+vector<SymbolInfo> blockCodes(span<const unsigned char> data) {
+    Histogram hist = buildHistogram(data);
+    auto codes = buildShannonCodes(hist, true);
+    limitCodeLengths(codes, hist, DEFAULT_MAX_CODE_LENGTH);
+    return codes;
+}
+
+void encodePayload(span<const unsigned char> data, const vector<SymbolInfo>& codes, vector<unsigned char>& out) {
+    CodeTable table = makeCodeTable(codes);
+    out.clear();
+    BitWriter writer(out);
+    writer.writeSymbols(data, table, longestCode(codes));
+    writer.finish();
+}
+
+void BM_CalculateProbabilities(benchmark::State& state) {
+    auto data = corpus(state);
+    LoopTimer timer;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(calculateProbabilities(data));
+    }
+    timer.report(state, data.size());
+}
+
+void BM_BuildShannonCodes(benchmark::State& state) {
+    Histogram hist = buildHistogram(corpus(state));
+    vector<SymbolInfo> codes;
+    for (auto _ : state) {
+        buildShannonCodes(hist, codes, true);
+        limitCodeLengths(codes, hist, DEFAULT_MAX_CODE_LENGTH);
+        benchmark::DoNotOptimize(codes.data());
+    }
+}
+
+void BM_BuildHuffmanCodes(benchmark::State& state) {
+    Histogram hist = buildHistogram(corpus(state));
+    vector<SymbolInfo> codes;
+    vector<vector<HuffmanCoin>> levels;
+    for (auto _ : state) {
+        buildHuffmanCodes(hist, DEFAULT_MAX_CODE_LENGTH, codes, levels);
+        benchmark::DoNotOptimize(codes.data());
+    }
+}
+
+void BM_WriteCodeTable(benchmark::State& state) {
+    auto codes = blockCodes(corpus(state));
+    vector<unsigned char> out;
+    for (auto _ : state) {
+        out.clear();
+        BitWriter writer(out);
+        writeCodeTable(writer, codes);
+        writer.finish();
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+
+void BM_ReadCodeTable(benchmark::State& state) {
+    auto codes = blockCodes(corpus(state));
+    vector<unsigned char> table;
+    BitWriter writer(table);
+    writeCodeTable(writer, codes);
+    writer.finish();
+
+    vector<SymbolInfo> decoded;
+    DecodeTable decode_table;
+    for (auto _ : state) {
+        BitReader reader(table.data(), table.size());
+        if (!readCodeTable(reader, decoded) || !decode_table.build(decoded)) state.SkipWithError("bad table");
+        benchmark::DoNotOptimize(decoded.data());
+    }
+}
+
+void BM_EncodePayload(benchmark::State& state) {
+    auto data = corpus(state);
+    auto codes = blockCodes(data);
+    vector<unsigned char> out;
+    LoopTimer timer;
+    for (auto _ : state) {
+        encodePayload(data, codes, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    timer.report(state, data.size());
+}
+
+void BM_DecodePayload(benchmark::State& state) {
+    auto data = corpus(state);
+    auto codes = blockCodes(data);
+    vector<unsigned char> payload;
+    encodePayload(data, codes, payload);
+    DecodeTable table;
+    table.build(codes);
+
+    vector<unsigned char> out(data.size());
+    LoopTimer timer;
+    for (auto _ : state) {
+        BitReader reader(payload.data(), payload.size());
+        if (table.decode(reader, out.data(), out.size()) != out.size()) state.SkipWithError("short decode");
+        benchmark::DoNotOptimize(out.data());
+    }
+    timer.report(state, data.size());
+}
+
+// The same payload split into interleaved streams
+void BM_DecodeInterleaved(benchmark::State& state) {
+    auto data = corpus(state);
+    vector<unsigned char> body, streams;
+    writeInterleavedBody(data, blockCodes(data), body, streams);
+    DecodeScratch scratch;
+
+    vector<unsigned char> out(data.size());
+    LoopTimer timer;
+    for (auto _ : state) {
+        if (!decodeInterleavedBody(body, out.data(), out.size(), scratch)) state.SkipWithError("bad streams");
+        benchmark::DoNotOptimize(out.data());
+    }
+    timer.report(state, data.size());
+}
+
+// Whole containers on one thread, every candidate coder included
+void BM_Encode(benchmark::State& state) {
+    auto data = corpus(state);
+    EncodeOptions options;
+    options.threads = 1;
+    EncodeContext context(options);
+    vector<uint8_t> out;
+    LoopTimer timer;
+    for (auto _ : state) {
+        context.encode(data, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.counters["ratio"] = static_cast<double>(out.size()) / max<size_t>(1, data.size());
+    timer.report(state, data.size());
+}
+
+void BM_Decode(benchmark::State& state) {
+    auto data = corpus(state);
+    EncodeOptions options;
+    options.threads = 1;
+    vector<uint8_t> encoded = encode(data, options);
+    DecodeContext context(1);
+    vector<uint8_t> out;
+    LoopTimer timer;
+    for (auto _ : state) {
+        if (!context.decode(encoded, out)) state.SkipWithError("decode failed");
+        benchmark::DoNotOptimize(out.data());
+    }
+    timer.report(state, data.size());
+}
+
+const vector<int64_t> CORPORA = { CORPUS_TEXT, CORPUS_RANDOM, CORPUS_SKEWED, CORPUS_BINARY };
+const vector<int64_t> SIZES = { 1 << 10, 1 << 15, 1 << 20, 1 << 25, int64_t(1) << 30 };
+
+// Table stages depend only on the histogram, taken from 1 MB of each corpus
+#define STAGE_BENCHMARK(name) BENCHMARK(name)->ArgsProduct({ CORPORA, { 0 } })
+#define SIZED_BENCHMARK(name) BENCHMARK(name)->ArgsProduct({ CORPORA, SIZES })->Unit(benchmark::kMicrosecond)
+
+SIZED_BENCHMARK(BM_CalculateProbabilities);
+STAGE_BENCHMARK(BM_BuildShannonCodes);
+STAGE_BENCHMARK(BM_BuildHuffmanCodes);
+STAGE_BENCHMARK(BM_WriteCodeTable);
+STAGE_BENCHMARK(BM_ReadCodeTable);
+SIZED_BENCHMARK(BM_EncodePayload);
+SIZED_BENCHMARK(BM_DecodePayload);
+SIZED_BENCHMARK(BM_DecodeInterleaved);
+SIZED_BENCHMARK(BM_Encode);
+SIZED_BENCHMARK(BM_Decode);
+
+BENCHMARK_MAIN();
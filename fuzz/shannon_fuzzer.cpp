@@ -0,0 +1,386 @@
+// Differential fuzz target for the fast paths. Every input is checked three
+// ways: the word-at-a-time bit kernels against a bit-serial coder, the
+// legacy reader against the original program's encoder and decoder, and
+// containers under every option against the bytes they were coded from.
+// Arbitrary input is also fed to every decoder, which must reject it
+// without crashing. Shannon.cpp is compiled in, as for the benchmark.
+//
+// With libFuzzer (Clang):
+//   clang++ -O1 -g -std=c++20 -pthread -fsanitize=fuzzer,address,undefined fuzz/shannon_fuzzer.cpp -o shannon_fuzzer
+//   ./shannon_fuzzer -max_len=16384 CORPUS_DIR
+// Without it (GCC), the same checks run on files or on generated inputs:
+//   g++ -O1 -g -std=c++20 -pthread -fsanitize=address,undefined -DSHANNON_FUZZ_STANDALONE fuzz/shannon_fuzzer.cpp -o shannon_fuzzer
+//   ./shannon_fuzzer FILE...
+//   ./shannon_fuzzer --random 10000
+#include "../Shannon.cpp"
+
+#include <bit>
+#include <map>
+#include <random>
+#include <sstream>
+
+using namespace shannon;
+using namespace shannon::detail;
+
+void check(bool condition, const char* what) {
+    if (condition) return;
+    cerr << "Error: " << what << "!" << endl;
+    abort();
+}
+
+// The original program's Shannon codes: '0'/'1' strings from the
+// floating-point construction, symbols by descending probability
+vector<pair<unsigned char, string>> referenceCodes(span<const unsigned char> data) {
+    map<unsigned char, int> freq;
+    for (unsigned char c : data) freq[c]++;
+    vector<pair<unsigned char, double>> symbols;
+    for (const auto& entry : freq) symbols.push_back({ entry.first, static_cast<double>(entry.second) / data.size() });
+    sort(symbols.begin(), symbols.end(), [](const auto& a, const auto& b) {
+        return a.second > b.second;
+        });
+
+    vector<pair<unsigned char, string>> codes;
+    double sum = 0.0;
+    for (const auto& symbol : symbols) {
+        int code_length = static_cast<int>(ceil(log2(1.0 / symbol.second)));
+        double q = sum;
+        sum += symbol.second;
+        string code;
+        for (int i = 0; i < code_length; ++i) {
+            q *= 2;
+            code += (q >= 1.0) ? '1' : '0';
+            if (q >= 1.0) q -= 1.0;
+        }
+        codes.push_back({ symbol.first, code });
+    }
+    return codes;
+}
+
+// Packs '0'/'1' strings MSB first, one bit at a time, padding with zeros
+class ReferenceBits {
+public:
+    void put(const string& code) {
+        for (char bit : code) {
+            if (bit == '1') buffer |= 1 << (7 - bit_pos);
+            if (++bit_pos == 8) flush();
+        }
+    }
+
+    vector<unsigned char> finish() {
+        if (bit_pos > 0) flush();
+        return bytes;
+    }
+
+private:
+    vector<unsigned char> bytes;
+    unsigned char buffer = 0;
+    int bit_pos = 0;
+
+    void flush() {
+        bytes.push_back(buffer);
+        buffer = 0;
+        bit_pos = 0;
+    }
+};
+
+// The original encodeFile output for `data`
+vector<unsigned char> referenceEncode(span<const unsigned char> data) {
+    auto codes = referenceCodes(data);
+    map<unsigned char, string> code_map(codes.begin(), codes.end());
+
+    vector<unsigned char> file(sizeof(size_t));
+    size_t symbol_count = codes.size();
+    memcpy(file.data(), &symbol_count, sizeof(symbol_count));
+    for (const auto& code : codes) {
+        file.push_back(code.first);
+        file.push_back(static_cast<unsigned char>(code.second.size()));
+        ReferenceBits bits;
+        bits.put(code.second);
+        auto packed = bits.finish();
+        file.insert(file.end(), packed.begin(), packed.end());
+    }
+    ReferenceBits payload;
+    for (unsigned char c : data) payload.put(code_map[c]);
+    auto packed = payload.finish();
+    file.insert(file.end(), packed.begin(), packed.end());
+    return file;
+}
+
+// Bit-serial matcher of the original decodeFile: bits are appended to the
+// current code until it names a symbol. `limit` stops after that many.
+vector<unsigned char> referenceMatch(span<const unsigned char> payload, const map<string, unsigned char>& decode_map,
+    size_t limit = SIZE_MAX) {
+    vector<unsigned char> out;
+    string current_code;
+    for (unsigned char byte : payload) {
+        for (int i = 7; i >= 0 && out.size() < limit; --i) {
+            current_code += (byte & (1 << i)) ? '1' : '0';
+            auto it = decode_map.find(current_code);
+            if (it != decode_map.end()) {
+                out.push_back(it->second);
+                current_code.clear();
+            }
+        }
+    }
+    return out;
+}
+
+// The original decodeFile on a file written by referenceEncode
+vector<unsigned char> referenceDecode(span<const unsigned char> file) {
+    size_t symbol_count;
+    memcpy(&symbol_count, file.data(), sizeof(symbol_count));
+    size_t pos = sizeof(symbol_count);
+    map<string, unsigned char> decode_map;
+    for (size_t i = 0; i < symbol_count; ++i) {
+        unsigned char symbol = file[pos++];
+        int code_length = file[pos++];
+        string code;
+        for (int bits_read = 0; bits_read < code_length; ++pos) {
+            for (int j = 7; j >= 0 && bits_read < code_length; j--, bits_read++) {
+                code += (file[pos] & (1 << j)) ? '1' : '0';
+            }
+        }
+        decode_map[code] = symbol;
+    }
+    return referenceMatch(file.subspan(pos), decode_map);
+}
+
+// Kernels against the bit-serial coder on one code set
+void checkKernels(span<const unsigned char> data, const vector<SymbolInfo>& codes) {
+    ReferenceBits reference;
+    map<string, unsigned char> decode_map;
+    map<unsigned char, string> code_map;
+    for (const auto& info : codes) {
+        code_map[info.symbol] = codeString(info);
+        decode_map[codeString(info)] = info.symbol;
+    }
+    for (unsigned char c : data) reference.put(code_map[c]);
+    vector<unsigned char> expected = reference.finish();
+
+    CodeTable table = makeCodeTable(codes);
+    vector<unsigned char> fast, serial;
+    {
+        BitWriter writer(fast);
+        writer.writeSymbols(data, table, longestCode(codes));
+        writer.finish();
+    }
+    {
+        BitWriter writer(serial);
+        for (unsigned char c : data) writer.write(table[c]);
+        writer.finish();
+    }
+    check(fast == expected, "writeSymbols differs from the bit-serial writer");
+    check(serial == expected, "BitWriter::write differs from the bit-serial writer");
+    if (longestCode(codes) > 0) {
+        auto matched = referenceMatch(expected, decode_map, data.size());
+        check(equal(data.begin(), data.end(), matched.begin(), matched.end()), "bit-serial matcher lost symbols");
+    }
+
+    DecodeTable decode_table;
+    check(decode_table.build(codes), "decode table rejected valid codes");
+    vector<unsigned char> decoded(data.size());
+    BitReader reader(expected.data(), expected.size());
+    check(decode_table.decode(reader, decoded.data(), decoded.size()) == data.size(), "short decode");
+    check(equal(data.begin(), data.end(), decoded.begin()), "DecodeTable::decode differs from the input");
+
+    BitReader symbol_reader(expected.data(), expected.size());
+    for (size_t i = 0; i < data.size(); ++i) {
+        unsigned char symbol;
+        check(decode_table.decodeSymbol(symbol_reader, symbol) && symbol == data[i], "decodeSymbol differs from the input");
+    }
+
+    if (longestCode(codes) == 0) return;
+    vector<unsigned char> body, streams;
+    writeInterleavedBody(data, codes, body, streams);
+    DecodeScratch scratch;
+    vector<unsigned char> interleaved(data.size());
+    check(decodeInterleavedBody(body, interleaved.data(), interleaved.size(), scratch), "interleaved body rejected");
+    check(equal(data.begin(), data.end(), interleaved.begin()), "interleaved decode differs from the input");
+}
+
+// Option bits taken from the first input byte
+enum FuzzOptions : uint8_t {
+    FUZZ_ORDER1 = 0x01,
+    FUZZ_INTERLEAVED = 0x02,
+    FUZZ_RANS = 0x04,
+    FUZZ_RLE = 0x08,
+    FUZZ_BWT = 0x10,
+    FUZZ_CHECKSUMS = 0x20,
+    FUZZ_SMALL_BLOCKS = 0x40,
+    FUZZ_DICTIONARY = 0x80,
+};
+
+void checkContainers(span<const unsigned char> data, uint8_t selector, uint8_t shape) {
+    EncodeOptions options;
+    options.threads = (selector & FUZZ_SMALL_BLOCKS) ? 2 : 1;
+    options.block_size = (selector & FUZZ_SMALL_BLOCKS) ? 1 + shape * 16 : DEFAULT_BLOCK_SIZE;
+    options.order1 = selector & FUZZ_ORDER1;
+    options.interleaved = selector & FUZZ_INTERLEAVED;
+    options.backend = (selector & FUZZ_RANS) ? BACKEND_RANS : BACKEND_PREFIX;
+    options.max_code_length = MIN_CODE_LENGTH_LIMIT + shape % (MAX_TABLE_CODE_LENGTH - MIN_CODE_LENGTH_LIMIT + 1);
+    options.transforms = ((selector & FUZZ_RLE) ? TRANSFORM_RLE : 0) | ((selector & FUZZ_BWT) ? TRANSFORM_BWT : 0);
+    options.block_checksums = selector & FUZZ_CHECKSUMS;
+    options.stream_checksum = selector & FUZZ_CHECKSUMS;
+    options.verify = true;
+    Dictionary dictionary;
+    if (selector & FUZZ_DICTIONARY) {
+        dictionary = trainDictionary({ data.first(data.size() / 2) });
+        options.dictionary = &dictionary;
+    }
+
+    vector<uint8_t> encoded = encode(data, options);
+    check(!encoded.empty(), "verification failed");
+    for (unsigned threads : { 1u, 3u }) {
+        vector<uint8_t> decoded;
+        check(decode(encoded, decoded, threads, options.dictionary), "container rejected");
+        check(decoded.size() == data.size() && equal(data.begin(), data.end(), decoded.begin()),
+            "container decodes to other bytes");
+    }
+
+    // Input of one block is coded and decoded on the calling thread however
+    // many threads are allowed, by the buffer coders and the file decoder's
+    // block loop alike
+    if (data.size() <= options.block_size) {
+        uint64_t started = ThreadPool::workersStarted();
+        EncodeOptions wide = options;
+        wide.threads = 8;
+        vector<uint8_t> single = encode(data, wide), decoded;
+        check(decode(single, decoded, 8, options.dictionary), "single block rejected");
+        ContainerInfo info;
+        check(readContainer(single, info), "single block container rejected");
+        decoded.assign(static_cast<size_t>(info.total_size), 0);
+        check(decodeBlocks(single, info, decoded.data(), 0, info.total_size, 8u, options.dictionary)
+            && equal(data.begin(), data.end(), decoded.begin(), decoded.end()), "single block decodes to other bytes");
+        check(ThreadPool::workersStarted() == started, "a single block started worker threads");
+    }
+
+    // Streaming coders fed in pieces of `shape` + 1 bytes
+    size_t piece = size_t(shape) + 1;
+    ostringstream streamed;
+    StreamEncoder encoder(streamed, options);
+    for (size_t offset = 0; offset < data.size(); offset += piece) {
+        check(encoder.write(data.subspan(offset, min(piece, data.size() - offset))), "stream encoder failed");
+    }
+    check(encoder.finish(), "stream encoder failed");
+    string container = streamed.str();
+    ostringstream restored;
+    StreamDecoder decoder(restored, options.dictionary);
+    auto bytes = span<const uint8_t>(reinterpret_cast<const uint8_t*>(container.data()), container.size());
+    for (size_t offset = 0; offset < bytes.size(); offset += piece) {
+        check(decoder.write(bytes.subspan(offset, min(piece, bytes.size() - offset))), "stream decoder failed");
+    }
+    check(decoder.finish(), "stream decoder failed");
+    string output = restored.str();
+    check(output.size() == data.size() && equal(data.begin(), data.end(), reinterpret_cast<const uint8_t*>(output.data())),
+        "stream decodes to other bytes");
+
+    uint64_t offset = data.empty() ? 0 : shape * 7919u % data.size();
+    uint64_t length = data.size() / (1 + shape % 4) + 1;
+    vector<uint8_t> range;
+    check(decodeRange(encoded, offset, length, range, 2, options.dictionary), "range rejected");
+    uint64_t end = min<uint64_t>(data.size(), offset + length);
+    check(equal(data.begin() + offset, data.begin() + end, range.begin(), range.end()), "range decodes to other bytes");
+
+    // A range reads only the headers of the blocks it decodes, so a bad mode
+    // in the last block fails a full decode but not a range in the first
+    ContainerInfo info;
+    if (readContainer(encoded, info) && (info.flags & FLAG_BLOCK_INDEX) && info.blocks.size() > 1) {
+        vector<uint8_t> damaged = encoded, decoded;
+        damaged[info.blocks.back().offset] = 0xFF;
+        check(readContainer(damaged, info), "index read a block header");
+        check(!decode(damaged, decoded, 2, options.dictionary), "bad block mode accepted");
+        check(decodeRange(damaged, 0, info.blocks[0].raw_size, range, 2, options.dictionary)
+            && equal(range.begin(), range.end(), data.begin()), "range read a block outside it");
+    }
+
+    // A damaged container is either rejected or decoded without crashing
+    if (!encoded.empty()) {
+        encoded[shape * 131u % encoded.size()] ^= static_cast<uint8_t>(1 + selector);
+        vector<uint8_t> decoded;
+        decode(encoded, decoded, 2, options.dictionary);
+    }
+}
+
+void checkDecoders(span<const unsigned char> input) {
+    vector<uint8_t> out;
+    decode(input, out, 2);
+    decodeRange(input, 0, input.size(), out, 2);
+    ostringstream sink;
+    StreamDecoder decoder(sink);
+    if (decoder.write(input)) decoder.finish();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* bytes, size_t size) {
+    span<const unsigned char> input(bytes, size);
+    checkDecoders(input);
+    if (size < 2) return 0;
+    uint8_t selector = input[0];
+    uint8_t shape = input[1];
+    auto data = input.subspan(2);
+
+    auto legacy = referenceEncode(data);
+    vector<uint8_t> decoded;
+    check(decode(legacy, decoded, 1), "legacy file rejected");
+    check(decoded == referenceDecode(legacy), "legacy decode differs from the original decoder");
+
+    if (!data.empty()) {
+        Histogram hist = buildHistogram(data);
+        int limit = MIN_CODE_LENGTH_LIMIT + shape % (MAX_TABLE_CODE_LENGTH - MIN_CODE_LENGTH_LIMIT + 1);
+        auto shannon = buildShannonCodes(hist, true);
+        limitCodeLengths(shannon, hist, limit);
+        checkKernels(data, shannon);
+        checkKernels(data, buildHuffmanCodes(hist, limit));
+    }
+    checkContainers(data, selector, shape);
+    return 0;
+}
+
+#ifdef SHANNON_FUZZ_STANDALONE
+// Generated inputs mix runs, text-like bytes, skewed and random bytes
+vector<uint8_t> generateInput(mt19937_64& rng) {
+    vector<uint8_t> input = { static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()) };
+    size_t size = rng() % 2 ? rng() % 64 : rng() % 20000;
+    while (input.size() < size + 2) {
+        size_t part = 1 + rng() % 512;
+        switch (rng() % 4) {
+        case 0:
+            input.insert(input.end(), part, static_cast<uint8_t>(rng()));
+            break;
+        case 1:
+            for (size_t i = 0; i < part; ++i) input.push_back(static_cast<uint8_t>('a' + rng() % 26));
+            break;
+        case 2:
+            for (size_t i = 0; i < part; ++i) input.push_back(static_cast<uint8_t>(countr_zero(rng() | (uint64_t(1) << 40))));
+            break;
+        default:
+            for (size_t i = 0; i < part; ++i) input.push_back(static_cast<uint8_t>(rng()));
+        }
+    }
+    input.resize(size + 2);
+    return input;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 3 && string(argv[1]) == "--random") {
+        mt19937_64 rng(1);
+        long count = atol(argv[2]);
+        for (long i = 0; i < count; ++i) {
+            auto input = generateInput(rng);
+            LLVMFuzzerTestOneInput(input.data(), input.size());
+        }
+        cout << count << " inputs checked" << endl;
+        return 0;
+    }
+    for (int i = 1; i < argc; ++i) {
+        ifstream in(argv[i], ios::binary);
+        if (!in) {
+            cerr << "Error: Cannot open " << argv[i] << "!" << endl;
+            return 1;
+        }
+        vector<uint8_t> input((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    cout << argc - 1 << " inputs checked" << endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,447 @@
+#include "Shannon.h"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <span>
+#include <chrono>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <glob.h>
+#endif
+
+using namespace std;
+using namespace shannon;
+
+constexpr const char* COMPRESSED_SUFFIX = ".shn";
+// Output name meaning standard output, or input meaning standard input
+constexpr const char* STANDARD_STREAM = "-";
+
+void printEncodeSummary(uint64_t original_size, uint64_t compressed_size) {
+    cout << "File successfully encoded." << endl;
+    cout << "Original size: " << original_size << " bytes" << endl;
+    cout << "Compressed size: " << compressed_size << " bytes" << endl;
+    if (original_size) cout << "Compression ratio: " << (compressed_size * 100 / original_size) << "%" << endl;
+}
+
+// Report for --stats on stderr, as a table or a single JSON line. Rates are
+// of uncompressed bytes; block stages are summed over threads.
+void printStats(const CodingStats& stats, bool compress, double seconds, bool json) {
+    struct Stage {
+        const char* name;
+        double seconds;
+    };
+    const Stage stages[] = {
+        { "read", stats.read_seconds },
+        { "histogram", stats.histogram_seconds },
+        { "table", stats.table_seconds },
+        { compress ? "encode" : "decode", stats.code_seconds },
+        { "transform", stats.transform_seconds },
+        { "verify", stats.verify_seconds },
+        { "write", stats.write_seconds },
+        { "total", seconds },
+    };
+    auto rate = [&](double stage_seconds) {
+        return stage_seconds > 0 ? static_cast<double>(stats.raw_bytes) / 1e6 / stage_seconds : 0.0;
+    };
+    auto perSymbol = [&](double bits) {
+        return stats.symbols ? bits / static_cast<double>(stats.symbols) : 0.0;
+    };
+    double miss_rate = stats.table_lookups
+        ? static_cast<double>(stats.table_misses) / static_cast<double>(stats.table_lookups) : 0.0;
+
+    if (json) {
+        cerr << "{\"mode\":\"" << (compress ? "encode" : "decode") << "\"";
+        for (const auto& stage : stages) {
+            // The coding stage keeps one key for both directions
+            string key = &stage == &stages[3] ? "code" : stage.name;
+            cerr << ",\"" << key << "_seconds\":" << stage.seconds << ",\"" << key << "_mbps\":" << rate(stage.seconds);
+        }
+        cerr << ",\"raw_bytes\":" << stats.raw_bytes << ",\"container_bytes\":" << stats.container_bytes
+            << ",\"stored_bytes\":" << stats.stored_bytes << ",\"symbols\":" << stats.symbols
+            << ",\"payload_bits\":" << stats.payload_bits << ",\"table_bits\":" << stats.table_bits
+            << ",\"bits_per_symbol\":" << perSymbol(static_cast<double>(stats.payload_bits))
+            << ",\"entropy_bits_per_symbol\":" << perSymbol(stats.entropy_bits)
+            << ",\"table_lookups\":" << stats.table_lookups << ",\"table_misses\":" << stats.table_misses
+            << ",\"table_miss_rate\":" << miss_rate << "}" << endl;
+        return;
+    }
+
+    cerr << fixed << setprecision(3);
+    cerr << left << setw(12) << "Stage" << right << setw(12) << "Seconds" << setw(12) << "MB/s" << endl;
+    for (const auto& stage : stages) {
+        cerr << left << setw(12) << stage.name << right << setw(12) << stage.seconds << setw(12) << rate(stage.seconds) << endl;
+    }
+    cerr << "Bytes: " << stats.raw_bytes << " raw, " << stats.container_bytes << " coded, "
+        << stats.stored_bytes << " in stored blocks" << endl;
+    cerr << "Payload: " << stats.payload_bits << " bits, " << perSymbol(static_cast<double>(stats.payload_bits))
+        << " bits/byte against " << perSymbol(stats.entropy_bits) << " of entropy; tables "
+        << stats.table_bits << " bits" << endl;
+    if (!compress) {
+        cerr << "Table misses: " << stats.table_misses << " of " << stats.table_lookups << " lookups ("
+            << miss_rate * 100 << "%)" << endl;
+    }
+    cerr << defaultfloat;
+}
+
+// Shells on Windows do not expand wildcards, and patterns without a match
+// are passed through so the open error names them
+vector<string> expandPatterns(const vector<string>& patterns) {
+    vector<string> files;
+    for (const auto& pattern : patterns) {
+#ifdef _WIN32
+        files.push_back(pattern);
+#else
+        glob_t matches;
+        if (pattern == STANDARD_STREAM || glob(pattern.c_str(), GLOB_NOCHECK, nullptr, &matches) != 0) {
+            files.push_back(pattern);
+            continue;
+        }
+        for (size_t i = 0; i < matches.gl_pathc; ++i) files.push_back(matches.gl_pathv[i]);
+        globfree(&matches);
+#endif
+    }
+    return files;
+}
+
+// Output name for an input processed without -o
+string defaultOutput(const string& input, bool compress) {
+    string suffix = COMPRESSED_SUFFIX;
+    if (compress) return input + suffix;
+    if (input.size() > suffix.size() && input.compare(input.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        return input.substr(0, input.size() - suffix.size());
+    }
+    return input + ".out";
+}
+
+struct Job {
+    string input;
+    string output;
+};
+
+// Slice of the original data to decode with --range
+struct Range {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// OFFSET:LENGTH in bytes
+bool parseRange(const string& text, Range& range) {
+    size_t colon = text.find(':');
+    if (colon == string::npos || colon == 0 || colon + 1 == text.size()) return false;
+    string offset = text.substr(0, colon), length = text.substr(colon + 1);
+    auto digits = [](const string& part) {
+        return all_of(part.begin(), part.end(), [](char c) { return c >= '0' && c <= '9'; });
+    };
+    if (!digits(offset) || !digits(length)) return false;
+    range.offset = strtoull(offset.c_str(), nullptr, 10);
+    range.length = strtoull(length.c_str(), nullptr, 10);
+    return true;
+}
+
+// Ranges are read from the block index, so the input has to be a file
+bool runRangeJob(const Job& job, const Range& range, const EncodeOptions& options) {
+    if (job.input == STANDARD_STREAM) {
+        cerr << "Error: --range needs an input file!" << endl;
+        return false;
+    }
+    if (job.output == STANDARD_STREAM) {
+        bool ok = decodeFileRange(job.input, cout, range.offset, range.length, options.threads, options.dictionary);
+        cout.flush();
+        return ok;
+    }
+    ofstream out(job.output, ios::binary);
+    if (!out) {
+        cerr << "Error: Cannot create output file!" << endl;
+        return false;
+    }
+    return decodeFileRange(job.input, out, range.offset, range.length, options.threads, options.dictionary);
+}
+
+template <class Coder>
+bool feed(istream& in, Coder& coder, CodingStats* stats) {
+    vector<uint8_t> chunk(DEFAULT_BLOCK_SIZE);
+    while (in) {
+        auto start = chrono::steady_clock::now();
+        in.read(reinterpret_cast<char*>(chunk.data()), chunk.size());
+        if (stats) stats->read_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        span<const uint8_t> got(chunk.data(), static_cast<size_t>(in.gcount()));
+        if (got.empty()) break;
+        if (!coder.write(got)) return false;
+    }
+    return !in.bad() && coder.finish();
+}
+
+// Pipes go through the streaming coder, which never needs the whole input
+bool runStreamJob(istream& in, ostream& out, bool compress, const EncodeOptions& options) {
+    bool ok;
+    if (compress) {
+        StreamEncoder encoder(out, options);
+        ok = feed(in, encoder, options.stats);
+    }
+    else {
+        // Only the totals: the streaming decoder has no per-block counters
+        StreamDecoder decoder(out, options.dictionary);
+        ok = feed(in, decoder, options.stats);
+        if (options.stats) options.stats->raw_bytes += decoder.bytesWritten();
+    }
+    out.flush();
+    return ok && static_cast<bool>(out);
+}
+
+bool runJob(const Job& job, bool compress, const EncodeOptions& options, const Range* range) {
+    if (!compress && range) return runRangeJob(job, *range, options);
+    if (job.input != STANDARD_STREAM && job.output != STANDARD_STREAM) {
+        uint64_t original_size, compressed_size;
+        return compress ? encodeFile(job.input, job.output, options, original_size, compressed_size)
+            : decodeFile(job.input, job.output, options.threads, options.dictionary, options.stats);
+    }
+
+    ifstream file_in;
+    ofstream file_out;
+    if (job.input != STANDARD_STREAM) {
+        file_in.open(job.input, ios::binary);
+        if (!file_in) {
+            cerr << "Error: Cannot open input file!" << endl;
+            return false;
+        }
+    }
+    if (job.output != STANDARD_STREAM) {
+        file_out.open(job.output, ios::binary);
+        if (!file_out) {
+            cerr << "Error: Cannot create output file!" << endl;
+            return false;
+        }
+    }
+    istream& in = job.input == STANDARD_STREAM ? cin : file_in;
+    ostream& out = job.output == STANDARD_STREAM ? cout : file_out;
+    if (!runStreamJob(in, out, compress, options)) {
+        cerr << "Error: Failed while " << (compress ? "encoding" : "decoding") << "!" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Many small files gain nothing from splitting into blocks, so files are
+// spread over up to `options.threads` workers and the threads left over are
+// given to each file. Standard output keeps the input order. Per-file stats
+// are added into `options.stats`.
+bool runBatch(const vector<Job>& jobs, bool compress, const EncodeOptions& options, const Range* range) {
+    bool ordered = any_of(jobs.begin(), jobs.end(), [](const Job& job) {
+        return job.output == STANDARD_STREAM || job.input == STANDARD_STREAM;
+        });
+    unsigned workers = ordered ? 1 : static_cast<unsigned>(min<size_t>(options.threads, jobs.size()));
+    EncodeOptions job_options = options;
+    job_options.threads = max(1u, options.threads / max(1u, workers));
+
+    atomic<size_t> next{ 0 };
+    atomic<bool> ok{ true };
+    mutex report;
+    auto work = [&] {
+        for (size_t i = next++; i < jobs.size(); i = next++) {
+            CodingStats stats;
+            EncodeOptions file_options = job_options;
+            if (options.stats) file_options.stats = &stats;
+            bool done = runJob(jobs[i], compress, file_options, range);
+            lock_guard<mutex> lock(report);
+            if (options.stats) options.stats->add(stats);
+            if (done) continue;
+            ok = false;
+            cerr << "Error: Failed on " << jobs[i].input << "!" << endl;
+        }
+    };
+
+    vector<thread> threads;
+    for (unsigned i = 1; i < workers; ++i) threads.emplace_back(work);
+    work();
+    for (auto& t : threads) t.join();
+    return ok;
+}
+
+// Trains a dictionary on the whole of every input
+bool trainFiles(const vector<string>& inputs, const string& path, int max_code_length) {
+    vector<vector<uint8_t>> contents;
+    for (const auto& input : inputs) {
+        ifstream in(input, ios::binary);
+        if (!in) {
+            cerr << "Error: Cannot open " << input << "!" << endl;
+            return false;
+        }
+        contents.emplace_back(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    vector<span<const uint8_t>> samples(contents.begin(), contents.end());
+    Dictionary dictionary = trainDictionary(samples, max_code_length);
+    if (!saveDictionary(path, dictionary)) {
+        cerr << "Error: Cannot write dictionary file!" << endl;
+        return false;
+    }
+    cout << "Dictionary " << dictionary.id << " written to " << path << endl;
+    return true;
+}
+
+void printUsage(const char* program) {
+    string indent(string("Usage: ").size() + string(program).size(), ' ');
+    cerr << "Usage: " << program << " [--threads N] [--order1] [--interleaved] [--rans] [--max-length N]" << endl;
+    cerr << indent << " [--rle] [--bwt] [--checksum[=block|stream]] [--verify] [--dict DICT] [--stats[=json]]" << endl;
+    cerr << "       " << program << " -c|-d [-o OUTPUT | --stdout] [options] FILE|PATTERN..." << endl;
+    cerr << "       " << program << " -d --range OFFSET:LENGTH [-o OUTPUT | --stdout] FILE" << endl;
+    cerr << "       " << program << " --train DICT [--max-length N] FILE|PATTERN..." << endl;
+    cerr << "Without -c or -d the program asks for a mode and a file. '-' is standard input." << endl;
+    cerr << "--stats reports stage timings and coding counters on standard error." << endl;
+}
+
+int main(int argc, char* argv[]) {
+    EncodeOptions options;
+    int mode = 0;   // 'c', 'd', 't' (train) or 0 for the interactive prompt
+    string output;
+    string dictionary_path;
+    Dictionary dictionary;
+    CodingStats stats;
+    bool stats_json = false;
+    Range range;
+    bool has_range = false;
+    vector<string> patterns;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            options.threads = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "-c" || arg == "-d") {
+            mode = arg[1];
+        }
+        else if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        }
+        else if (arg == "--stdout") {
+            output = STANDARD_STREAM;
+        }
+        else if (arg == "--train" && i + 1 < argc) {
+            mode = 't';
+            dictionary_path = argv[++i];
+        }
+        else if (arg == "--dict" && i + 1 < argc) {
+            dictionary_path = argv[++i];
+            if (!loadDictionary(dictionary_path, dictionary)) {
+                cerr << "Error: Cannot read dictionary file!" << endl;
+                return 1;
+            }
+            options.dictionary = &dictionary;
+        }
+        else if (arg == "--order1") {
+            options.order1 = true;
+        }
+        else if (arg == "--interleaved") {
+            options.interleaved = true;
+        }
+        else if (arg == "--rle") {
+            options.transforms |= TRANSFORM_RLE;
+        }
+        else if (arg == "--bwt") {
+            // Move-to-front leaves runs of zeros for RLE to take
+            options.transforms |= TRANSFORM_BWT | TRANSFORM_RLE;
+        }
+        else if (arg == "--checksum" || arg == "--checksum=block" || arg == "--checksum=stream") {
+            options.block_checksums = arg != "--checksum=stream";
+            options.stream_checksum = arg != "--checksum=block";
+        }
+        else if (arg == "--verify") {
+            options.verify = true;
+        }
+        else if (arg == "--rans") {
+            options.backend = BACKEND_RANS;
+        }
+        else if (arg == "--range" && i + 1 < argc) {
+            if (!parseRange(argv[++i], range)) {
+                cerr << "Error: Expected --range OFFSET:LENGTH!" << endl;
+                return 1;
+            }
+            has_range = true;
+        }
+        else if (arg == "--stats" || arg == "--stats=json") {
+            options.stats = &stats;
+            stats_json = arg == "--stats=json";
+        }
+        else if (arg == "--max-length" && i + 1 < argc) {
+            options.max_code_length = clamp(atoi(argv[++i]), MIN_CODE_LENGTH_LIMIT, MAX_TABLE_CODE_LENGTH);
+        }
+        else if (arg == STANDARD_STREAM || arg[0] != '-') {
+            patterns.push_back(arg);
+        }
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (mode != 0 || !patterns.empty()) {
+        vector<string> inputs = expandPatterns(patterns);
+        if (mode == 0 || inputs.empty() || (has_range && mode != 'd') || (inputs.size() > 1 && !output.empty() && output != STANDARD_STREAM)) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (mode == 't') return trainFiles(inputs, dictionary_path, options.max_code_length) ? 0 : 1;
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        bool compress = mode == 'c';
+        vector<Job> jobs;
+        for (const auto& input : inputs) {
+            string target = output;
+            if (target.empty()) target = input == STANDARD_STREAM ? STANDARD_STREAM : defaultOutput(input, compress);
+            jobs.push_back({ input, target });
+        }
+        auto start = chrono::steady_clock::now();
+        bool ok = runBatch(jobs, compress, options, has_range ? &range : nullptr);
+        if (options.stats) {
+            printStats(stats, compress, chrono::duration<double>(chrono::steady_clock::now() - start).count(), stats_json);
+        }
+        return ok ? 0 : 1;
+    }
+
+    cout << "Enter '1' to compress, '2' to decompress or '3' to compress with bounded memory: ";
+
+    int choice;
+    cin >> choice;
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
+    cout << "Enter filename (exp.txt to compress | encode.txt to decompress): ";
+    string filename;
+    getline(cin, filename);
+
+    uint64_t original_size, compressed_size;
+    auto start = chrono::steady_clock::now();
+    bool done = false;
+    if (choice == 1) {
+        done = encodeFile(filename, "encode.txt", options, original_size, compressed_size);
+        if (done) printEncodeSummary(original_size, compressed_size);
+    }
+    else if (choice == 2) {
+        done = decodeFile(filename, "decode.txt", options.threads, options.dictionary, options.stats);
+        if (done) cout << "File successfully decoded." << endl;
+    }
+    else if (choice == 3) {
+        done = encodeFileStreaming(filename, "encode.txt", options, original_size, compressed_size);
+        if (done) printEncodeSummary(original_size, compressed_size);
+    }
+    else {
+        cerr << "Error: Invalid choice!" << endl;
+        return 1;
+    }
+    if (done && options.stats) {
+        printStats(stats, choice != 2, chrono::duration<double>(chrono::steady_clock::now() - start).count(), stats_json);
+    }
+
+    return 0;
+}